@@ -8,6 +8,10 @@
 #ifdef __SSE2__
 #include <emmintrin.h>
 #endif
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#include <chrono>
 /**
  * @file
  * Common Utility Operations
@@ -205,6 +209,32 @@ always_static_inline void pause(void) {
 always_static_inline void pause(void) {}
 #endif
 
+/**
+ * Cycle counter for coarse timing. Falls back to a nanosecond clock where
+ * no TSC is available.
+ */
+#ifdef __x86_64__
+always_static_inline uint64_t read_cycles(void) {
+    return __rdtsc();
+}
+
+/**
+ * Same as read_cycles but waits for the preceding loads to complete.
+ */
+always_static_inline uint64_t read_cycles_ordered(void) {
+    unsigned int aux;
+    return __rdtscp(&aux);
+}
+#else
+always_static_inline uint64_t read_cycles(void) {
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+always_static_inline uint64_t read_cycles_ordered(void) {
+    return read_cycles();
+}
+#endif
+
 enum class RESULT {
     OK = 0,
     ERROR = -1
@@ -219,6 +249,7 @@ const uint8_t kMaxCpuThreadCnt = 32;
 const uint8_t kMaxSiblingPerThread = 4;
 const uint8_t kMaxUsableInterfaceCnt =  2;
 const uint16_t kMaxlen = 1024;
+const uint8_t kCacheLineSize = 64;
 
 }  // namespace utils
 
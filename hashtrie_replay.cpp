@@ -0,0 +1,397 @@
+/**
+ * Trace driven lookup benchmark for HashTrie.
+ *
+ * Populates the trie from a host/prefix list and replays the destination
+ * IPv4 addresses of a pcap (or, with -r, a raw key trace) through HashTrieGetNode on
+ * one or more worker threads pinned to cores. With -b the trace is replayed
+ * in bursts, each under one HashTrie<T>::ReadGuard, as a poll loop would.
+ *
+ * Build : g++ -O3 -std=c++17 -pthread hashtrie_replay.cpp -o hashtrie_replay
+ * Usage : hashtrie_replay [-t threads] [-c first_core] [-n passes] [-b burst] [-r] <table> <trace>
+ *
+ * <table> : text file, one "a.b.c.d" or "a.b.c.d/len" (len >= 16) per line,
+ *           '#' starts a comment.
+ * <trace> : pcap (Ethernet, Linux cooked or raw IP link types), or with -r
+ *           a raw binary trace of big endian 32-bit keys. pcapng is not
+ *           read, convert it first: editcap -F pcap in.pcapng out.pcap
+ *
+ * Build with -DHASHTRIE_PROFILE to also report hardware counters per
+ * HashTrieAddNode/HashTrieGetNode and sampled per tier lookup timing.
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>  //  NOLINT
+#include <string>
+#include <thread>  //  NOLINT
+#include <vector>
+
+#include "mbit_trie.hpp"
+
+namespace replay {
+const uint32_t kPcapMagic        = 0xa1b2c3d4;
+const uint32_t kPcapMagicSwapped = 0xd4c3b2a1;
+const uint32_t kPcapMagicNsec    = 0xa1b23c4d;
+const uint32_t kPcapMagicNsecSwapped = 0x4d3cb2a1;
+const uint32_t kPcapngMagic      = 0x0a0d0d0a;   /* Section header block type, same in both byte orders */
+
+const uint32_t kLinkTypeEthernet = 1;
+const uint32_t kLinkTypeRaw      = 101;
+const uint32_t kLinkTypeLinuxSll = 113;
+
+const uint16_t kEtherTypeIPv4    = 0x0800;
+const uint16_t kEtherTypeVlan    = 0x8100;
+const uint16_t kEtherTypeQinQ    = 0x88a8;
+
+const int kMinPrefixLen = 16;
+
+struct PACKED(PcapFileHeader {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+});
+
+struct PACKED(PcapRecordHeader {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t incl_len;
+    uint32_t orig_len;
+});
+
+#ifdef HASHTRIE_PROFILE
+std::mutex report_lock;
+#endif
+
+struct WorkerStats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t cycles;
+    double   seconds;
+};
+
+always_static_inline uint16_t LoadBE16(const uint8_t* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+always_static_inline uint32_t LoadBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+always_static_inline uint32_t Swap32(uint32_t v, bool swap) {
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+//  Returns the destination address of an IPv4 packet in host order, or false
+//  if the frame does not carry IPv4.
+static bool ExtractDstIPv4(const uint8_t* frame, uint32_t len, uint32_t linktype,
+                           uint32_t* out_Key) {
+    uint32_t off = 0;
+    uint16_t ether_type = kEtherTypeIPv4;
+
+    switch (linktype) {
+        case kLinkTypeEthernet:
+            if (len < 14) {
+                return false;
+            }
+            ether_type = LoadBE16(frame + 12);
+            off = 14;
+            while ((kEtherTypeVlan == ether_type || kEtherTypeQinQ == ether_type) &&
+                   len >= off + 4) {
+                ether_type = LoadBE16(frame + off + 2);
+                off += 4;
+            }
+            break;
+        case kLinkTypeLinuxSll:
+            if (len < 16) {
+                return false;
+            }
+            ether_type = LoadBE16(frame + 14);
+            off = 16;
+            break;
+        case kLinkTypeRaw:
+            break;
+        default:
+            return false;
+    }
+
+    if (kEtherTypeIPv4 != ether_type || len < off + 20 ||
+        4 != (frame[off] >> 4)) {
+        return false;
+    }
+    *out_Key = LoadBE32(frame + off + 16);
+    return true;
+}
+
+static bool LoadPcap(FILE* fp, const PcapFileHeader& hdr, std::vector<uint32_t>* out_Keys) {
+    bool swap = (kPcapMagicSwapped == hdr.magic || kPcapMagicNsecSwapped == hdr.magic);
+    uint32_t linktype = Swap32(hdr.linktype, swap);
+    std::vector<uint8_t> frame;
+    PcapRecordHeader rec;
+
+    while (1 == fread(&rec, sizeof(rec), 1, fp)) {
+        uint32_t incl_len = Swap32(rec.incl_len, swap);
+        frame.resize(incl_len);
+        if (incl_len && 1 != fread(frame.data(), incl_len, 1, fp)) {
+            fprintf(stderr, "Truncated pcap record\n");
+            break;
+        }
+        uint32_t key;
+        if (ExtractDstIPv4(frame.data(), incl_len, linktype, &key)) {
+            out_Keys->push_back(key);
+        }
+    }
+    return !out_Keys->empty();
+}
+
+static bool LoadTrace(const char* path, bool raw_keys, std::vector<uint32_t>* out_Keys) {
+    FILE* fp = fopen(path, "rb");
+    if (nullptr == fp) {
+        fprintf(stderr, "Failed to open trace %s\n", path);
+        return false;
+    }
+
+    PcapFileHeader hdr;
+    bool ok = false;
+    if (raw_keys) {
+        uint8_t raw[4];
+        while (1 == fread(raw, sizeof(raw), 1, fp)) {
+            out_Keys->push_back(LoadBE32(raw));
+        }
+        ok = !out_Keys->empty();
+    } else if (1 != fread(&hdr, sizeof(hdr), 1, fp)) {
+        fprintf(stderr, "Trace %s is too short for a pcap file\n", path);
+    } else if (kPcapMagic == hdr.magic || kPcapMagicSwapped == hdr.magic ||
+               kPcapMagicNsec == hdr.magic || kPcapMagicNsecSwapped == hdr.magic) {
+        ok = LoadPcap(fp, hdr, out_Keys);
+    } else if (kPcapngMagic == hdr.magic) {
+        fprintf(stderr, "Trace %s is pcapng, convert it with: editcap -F pcap %s out.pcap\n",
+                path, path);
+    } else {
+        fprintf(stderr, "Trace %s is not a pcap file, use -r for a raw key trace\n", path);
+    }
+    fclose(fp);
+    return ok;
+}
+
+static bool ParseIPv4(const std::string& str, uint32_t* out_Addr, int* out_Len) {
+    unsigned a, b, c, d;
+    int len = 32;
+    int n = sscanf(str.c_str(), "%u.%u.%u.%u/%d", &a, &b, &c, &d, &len);
+    if (n < 4 || a > 255 || b > 255 || c > 255 || d > 255 ||
+        len < kMinPrefixLen || len > 32) {
+        return false;
+    }
+    *out_Addr = (a << 24) | (b << 16) | (c << 8) | d;
+    *out_Len = len;
+    return true;
+}
+
+//  The trie is exact match, so prefixes are expanded into their hosts.
+static bool LoadTable(const char* path, std::vector<uint32_t>* out_Keys) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "Failed to open table %s\n", path);
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        uint32_t addr;
+        int len;
+        if (!ParseIPv4(line.substr(line.find_first_not_of(" \t")), &addr, &len)) {
+            fprintf(stderr, "Skipping bad table entry: %s\n", line.c_str());
+            continue;
+        }
+        uint32_t hosts = 1u << (32 - len);
+        addr &= ~(hosts - 1);
+        for (uint32_t i = 0; i < hosts; i++) {
+            out_Keys->push_back(addr + i);
+        }
+    }
+    return !out_Keys->empty();
+}
+
+static void PinToCore(int core) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        fprintf(stderr, "Failed to pin worker to core %d\n", core);
+    }
+}
+
+static uint64_t ReplayBursts(hash::HashTrie<uint32_t>* trie, const std::vector<uint32_t>& trace,
+                             size_t burst) {
+    uint64_t hits = 0;
+    for (size_t i = 0; i < trace.size(); i += burst) {
+        hash::HashTrie<uint32_t>::ReadGuard guard(*trie);
+        size_t end = utils::MIN(i + burst, trace.size());
+        for (size_t j = i; j < end; j++) {
+            if (nullptr != guard.Get(trace[j])) {
+                hits++;
+            }
+        }
+    }
+    return hits;
+}
+
+static void Worker(hash::HashTrie<uint32_t>* trie, const std::vector<uint32_t>* trace,
+                   int passes, int burst, int core, std::atomic<int>* ready,
+                   WorkerStats* stats) {
+    PinToCore(core);
+    lock::RCU::set_reader_core(core);
+    ready->fetch_sub(1, std::memory_order_acq_rel);
+    while (0 != ready->load(std::memory_order_acquire)) {
+        utils::pause();
+    }
+
+    uint64_t hits = 0;
+#ifdef HASHTRIE_PROFILE
+    perf::PerfCounters counters;
+    perf::ThreadTierProfile().Reset();
+    counters.Start();
+#endif
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t c0 = utils::read_cycles();
+    for (int p = 0; p < passes; p++) {
+        if (burst > 0) {
+            hits += ReplayBursts(trie, *trace, burst);
+            continue;
+        }
+        for (uint32_t key : *trace) {
+            if (nullptr != trie->HashTrieGetNode(key)) {
+                hits++;
+            }
+        }
+    }
+    uint64_t c1 = utils::read_cycles();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    stats->lookups = static_cast<uint64_t>(passes) * trace->size();
+    stats->hits = hits;
+    stats->cycles = c1 - c0;
+    stats->seconds = elapsed.count();
+
+#ifdef HASHTRIE_PROFILE
+    counters.Stop();
+    std::lock_guard<std::mutex> guard(report_lock);
+    std::string label = "core " + std::to_string(core) + " HashTrieGetNode";
+    counters.Report(label.c_str(), stats->lookups);
+    perf::ThreadTierProfile().Report(label.c_str());
+#endif
+}
+}  //  namespace replay
+
+static void Usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-c first_core] [-n passes] [-b burst] [-r] "
+            "<table> <trace>\n", prog);
+}
+
+int main(int argc, char** argv) {
+    int threads = 1;
+    int first_core = 0;
+    int passes = 10;
+    int burst = 0;
+    bool raw_keys = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:c:n:b:rh")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'c':
+                first_core = atoi(optarg);
+                break;
+            case 'n':
+                passes = atoi(optarg);
+                break;
+            case 'b':
+                burst = atoi(optarg);
+                break;
+            case 'r':
+                raw_keys = true;
+                break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || threads < 1 || passes < 1 || burst < 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<uint32_t> table;
+    std::vector<uint32_t> trace;
+    if (!replay::LoadTable(argv[optind], &table) ||
+        !replay::LoadTrace(argv[optind + 1], raw_keys, &trace)) {
+        return 1;
+    }
+
+    hash::HashTrie<uint32_t>* trie = new hash::HashTrie<uint32_t>();
+    trie->HashTrieInitialize(first_core);
+    std::vector<uint32_t> values(table.size());
+#ifdef HASHTRIE_COMPRESSED_REFS
+    if (utils::RESULT::OK != trie->HashTrieRegisterValueTable(values.data(), values.size())) {
+        fprintf(stderr, "Failed to register value table\n");
+        return 1;
+    }
+#endif
+    size_t added = 0;
+#ifdef HASHTRIE_PROFILE
+    perf::PerfCounters counters;
+    counters.Start();
+#endif
+    for (size_t i = 0; i < table.size(); i++) {
+        values[i] = static_cast<uint32_t>(i);
+        if (utils::RESULT::OK == trie->HashTrieAddNode(table[i], &values[i])) {
+            added++;
+        }
+    }
+#ifdef HASHTRIE_PROFILE
+    counters.Stop();
+    counters.Report("HashTrieAddNode", table.size());
+#endif
+    printf("Table: %zu entries (%zu added), trace: %zu lookups x %d passes\n",
+           table.size(), added, trace.size(), passes);
+
+    std::vector<replay::WorkerStats> stats(threads);
+    std::vector<std::thread> workers;
+    std::atomic<int> ready(threads);
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(replay::Worker, trie, &trace, passes, burst, first_core + i,
+                             &ready, &stats[i]);
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+
+    double total_mpps = 0;
+    for (int i = 0; i < threads; i++) {
+        double mpps = stats[i].lookups / stats[i].seconds / 1e6;
+        total_mpps += mpps;
+        printf("core %3d: %8.2f Mpps  %7.1f cycles/lookup  hit %5.1f%%\n",
+               first_core + i, mpps,
+               static_cast<double>(stats[i].cycles) / stats[i].lookups,
+               100.0 * stats[i].hits / stats[i].lookups);
+    }
+    printf("total   : %8.2f Mpps\n", total_mpps);
+
+    delete trie;
+    return 0;
+}
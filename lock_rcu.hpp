@@ -4,52 +4,217 @@
 /**
  * This is a Read Copy Update type lock
  *
+ * Readers count themselves in a per core counter, the core being the one
+ * given to set_reader_core (or the cpu the thread first ran on). The
+ * counters exist to name the cores holding up a stalled grace period, not
+ * to spread contention: they are packed 16 to a cache line (about 512 bytes
+ * per RCU object), and writers only scan up to the highest core registered
+ * so far. A writer
+ * waiting for a grace period spins with pause, then yields, then blocks on
+ * a futex that a reader leaving its section wakes up. Grace periods running
+ * longer than kRCUStallReportUsec are reported with the protected slot and
+ * the cores whose readers are still inside.
  */
 #include <iostream>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
 #include <thread>  //  NOLINT
 #include <type_traits>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "common.hpp"
 
 namespace lock {
-const uint32_t kRCUPauseRepeatCount       =  0x0;     /* Repeat Pause and then yield */
+const uint32_t kRCUPauseRepeatCount       =  0x400;   /* Repeat Pause and then yield */
+const uint32_t kRCUYieldRepeatCount       =  0x40;    /* Repeat yield and then block */
+const uint32_t kRCUBlockSliceUsec         =  1000;    /* Longest single futex wait */
+const uint32_t kRCUStallReportUsec        =  100000;  /* Report grace periods longer than this */
 
 class RCU {
  public:
-    inline RCU() : cntr_(0) { }
+    inline RCU() : coreId(0), slotId(0), cntr_{}, waiters_(0), wake_seq_(0) { }
     virtual ~RCU() {
     }
 
+    //  Core the calling thread's read sections are accounted to. Pinned
+    //  workers should call it once at start up.
+    static inline void set_reader_core(uint8_t core) {
+        core %= utils::kMaxCpuCnt;
+        register_reader_core(core);
+        reader_core() = core;
+    }
+
+    inline void setSlotId(uint16_t slot) {
+        slotId = slot;
+    }
+
     inline void rcu_read_lock(void) {
-        cntr_.fetch_add(1, std::memory_order_acq_rel);
+        cntr_[reader_core()].fetch_add(1, std::memory_order_acq_rel);
     }
     inline void rcu_read_unlock(void) {
-        cntr_.fetch_sub(1, std::memory_order_acq_rel);
+        if (1 == cntr_[reader_core()].fetch_sub(1, std::memory_order_seq_cst) &&
+            unlikely(0 != waiters_.load(std::memory_order_seq_cst))) {
+            wake_writers();
+        }
     }
     inline void synchronize_rcu(void) {
-        unsigned rep = 0;
+        wait_for_readers(false, std::chrono::steady_clock::time_point());
+    }
+    //  Returns false if readers are still inside after timeout
+    template <typename Rep, typename Period>
+    inline bool try_synchronize_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return wait_for_readers(true, std::chrono::steady_clock::now() + timeout);
+    }
+    //  Non blocking: true once every reader that could see data unlinked
+    //  before this call has left, the writer can then reclaim it.
+    inline bool poll_synchronize_rcu(void) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return quiescent(std::memory_order_acquire);
+    }
+
+ protected:
+    uint8_t  coreId;   //  writer core
+    uint16_t slotId;   //  which protected object, for stall reports
+
+ private:
+    std::atomic<uint32_t> cntr_[utils::kMaxCpuCnt];
+    std::atomic<uint32_t> waiters_;
+    std::atomic<uint32_t> wake_seq_;  //  futex word
+
+    //  Highest reader core registered by any thread + 1, bounds the scans
+    static inline std::atomic<uint32_t> reader_core_span_{0};
+
+    static inline void register_reader_core(uint8_t core) {
+        uint32_t span = reader_core_span_.load(std::memory_order_relaxed);
+        while (span <= core &&
+               !reader_core_span_.compare_exchange_weak(span, core + 1u, std::memory_order_seq_cst)) {
+        }
+    }
+
+    static inline uint8_t first_reader_core() {
+#ifdef __linux__
+        uint8_t core = static_cast<uint8_t>(utils::MAX(sched_getcpu(), 0) % utils::kMaxCpuCnt);
+#else
+        uint8_t core = 0;
+#endif
+        register_reader_core(core);
+        return core;
+    }
+
+    static inline uint8_t& reader_core() {
+        static thread_local uint8_t core = first_reader_core();
+        return core;
+    }
+
+    inline bool quiescent(std::memory_order order) {
+        uint32_t span = reader_core_span_.load(std::memory_order_seq_cst);
+        for (uint32_t i = 0; i < span; i++) {
+            if (0 != cntr_[i].load(order)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void report_stall(std::chrono::microseconds stalled) {
+        std::string cores;
+        uint32_t span = reader_core_span_.load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < span; i++) {
+            uint32_t readers = cntr_[i].load(std::memory_order_relaxed);
+            if (0 != readers) {
+                cores += " " + std::to_string(i) + "(" + std::to_string(readers) + ")";
+            }
+        }
+        fprintf(stderr, "RCU grace period on slot %u (writer core %u) stalled for %ld us, "
+                "readers still inside on core(count):%s\n", slotId, coreId,
+                static_cast<long>(stalled.count()), cores.c_str());
+    }
+
+    never_inline void wake_writers(void) {
+        wake_seq_.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&wake_seq_),
+                FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+    inline void block(uint32_t seq, std::chrono::microseconds slice) {
+#ifdef __linux__
+        struct timespec ts;
+        ts.tv_sec = slice.count() / 1000000;
+        ts.tv_nsec = (slice.count() % 1000000) * 1000;
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&wake_seq_),
+                FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+#else
+        (void)seq;
+        std::this_thread::sleep_for(slice);
+#endif
+    }
+
+    bool wait_for_readers(bool bounded, std::chrono::steady_clock::time_point deadline) {
+        //  Order the unlinking store before the counter loads, or a reader
+        //  entering in between could see the old pointer while we read 0
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (uint32_t rep = 0; rep < kRCUPauseRepeatCount; rep++) {
+            if (quiescent(std::memory_order_acquire)) {
+                return true;
+            }
+            utils::pause();
+        }
+        for (uint32_t rep = 0; rep < kRCUYieldRepeatCount; rep++) {
+            if (quiescent(std::memory_order_acquire)) {
+                return true;
+            }
+            if (bounded && std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point next_report =
+                start + std::chrono::microseconds(kRCUStallReportUsec);
+        bool done = false;
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
         while (1) {
-            if (0 == cntr_.load(std::memory_order_acquire)) {
+            uint32_t seq = wake_seq_.load(std::memory_order_seq_cst);
+            if (quiescent(std::memory_order_seq_cst)) {
+                done = true;
                 break;
-            } else {
-                utils::pause();
-                if (kRCUPauseRepeatCount &&
-                    ++rep == kRCUPauseRepeatCount) {
-                    rep = 0;
-                    std::this_thread::yield();
-                }
             }
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (bounded && now >= deadline) {
+                break;
+            }
+            if (now >= next_report) {
+                report_stall(std::chrono::duration_cast<std::chrono::microseconds>(now - start));
+                next_report += std::chrono::microseconds(kRCUStallReportUsec);
+            }
+            std::chrono::microseconds slice(kRCUBlockSliceUsec);
+            if (bounded) {
+                slice = std::min(slice, std::chrono::duration_cast<std::chrono::microseconds>(
+                        deadline - now) + std::chrono::microseconds(1));
+            }
+            block(seq, slice);
         }
+        waiters_.fetch_sub(1, std::memory_order_seq_cst);
+        return done;
     }
-
- private:
-    std::atomic<uint64_t> cntr_;
 };
 
 template <typename T>
 class RCUProtected : public RCU {
  public:
-    RCUProtected() {}
+    RCUProtected() : RCU(), data_ptr_(nullptr) {}
     inline explicit RCUProtected(uint8_t coreID) : RCU() {
         data_ptr_ = NULL;
         coreId = coreID;
@@ -85,15 +250,16 @@ class RCUProtected : public RCU {
         return data_ptr_.load(std::memory_order_relaxed);
     }
 
+    //  Release: the new object's contents are visible before the pointer
     inline T* update(T* new_data_ptr) {
         T* old_data_ptr = data_ptr_.load(std::memory_order_relaxed);
-        data_ptr_.store(new_data_ptr, std::memory_order_relaxed);
+        data_ptr_.store(new_data_ptr, std::memory_order_release);
         return old_data_ptr;
     }
 
     inline void sync_update(T* new_data_ptr) {
         T* old_data_ptr = data_ptr_.load(std::memory_order_relaxed);
-        data_ptr_.store(new_data_ptr, std::memory_order_relaxed);
+        data_ptr_.store(new_data_ptr, std::memory_order_release);
         synchronize_rcu();
         delete old_data_ptr;
     }
@@ -104,7 +270,6 @@ class RCUProtected : public RCU {
 
  private:
     std::atomic<T*> data_ptr_;
-    uint8_t coreId;
 };
 
 
@@ -164,27 +329,6 @@ class RCUProtectedTwoCopy : public RCU {
     }
 
  private:
-    inline void rcu_read_lock(void) {
-       cntr_.fetch_add(1, std::memory_order_acq_rel);
-    }
-    inline void rcu_read_unlock(void) {
-       cntr_.fetch_sub(1, std::memory_order_acq_rel);
-    }
-    inline void synchronize_rcu(void) {
-       unsigned rep = 0;
-       while (1) {
-           if (0 == cntr_.load(std::memory_order_acquire)) {
-               break;
-           } else {
-               utils::pause();
-               if (kRCUPauseRepeatCount &&
-                   ++rep == kRCUPauseRepeatCount) {
-                   rep = 0;
-                   std::this_thread::yield();
-               }
-           }
-       }
-    }
     T* data_ptr1_;
     T* data_ptr2_;
     std::atomic<T*> data_ptr_;
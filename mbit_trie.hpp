@@ -1,57 +1,167 @@
 #ifndef USERPLANE_MBIT_TRIE_HPP_
 #define USERPLANE_MBIT_TRIE_HPP_
 
+#include <algorithm>
 #include <utility>
 #include <memory>
 #include <cstdio>
 #include <cstdarg>
 #include <iostream>
+#include <chrono>
+#include <cstdlib>
 
 #include <string>
+#include <vector>
 
 /**
  * Multi Bit Trie Arch. Used for IPv4 address lookup
  *
+ * Built with HASHTRIE_COMPRESSED_REFS, tier 2-4 nodes hold 32-bit indices
+ * into per tier node arenas instead of pointers, and leaves hold 32-bit
+ * handles into a value table registered with HashTrieRegisterValueTable.
+ * That halves the node size; the T* based API stays the same.
  */
 #include "singleton.hpp"
 #include "common.hpp"
 #include "lock_rcu.hpp"
+#ifdef HASHTRIE_COMPRESSED_REFS
+#include "node_arena.hpp"
+#endif
+#ifdef HASHTRIE_PROFILE
+#include "perf_counters.hpp"
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace hash {
 const int kHashTrieSize = 256;
+const uint16_t kCompactTiersPerStep = 4;     /* Tier-1 subtrees relaid out per step */
+const uint32_t kCompactIntervalUsec = 1000;  /* Minimum gap between two steps */
+const uint8_t  kCompactScatteredPct = 25;    /* Relay out once this share of live node bytes is off arena */
+const uint8_t  kCompactDeadPct = 50;         /* or once this share of the arena holds removed nodes */
+
+#ifdef HASHTRIE_COMPRESSED_REFS
+//  Index into the node arena of the child's tier (or into the value table
+//  for leaves), 0 is null
+template <typename N>
+using ChildRef = uint32_t;
+#else
+template <typename N>
+using ChildRef = N*;
+#endif
 
 template <typename T>
 struct NodesD {
-    T*           dataPtr[kHashTrieSize];
+    ChildRef<T>  dataPtr[kHashTrieSize];
     uint16_t     EffectiveNodeCount;
 };
 template <typename T>
 struct NodesC {
-    NodesD<T>* TierNode[kHashTrieSize];
-    uint16_t   EffectiveNodeCount;
+    ChildRef<NodesD<T>> TierNode[kHashTrieSize];
+    uint16_t            EffectiveNodeCount;
 };
 
 template <typename T>
 struct NodesB {
-    NodesC<T>* TierNode[kHashTrieSize];
-    uint16_t  EffectiveNodeCount;
+    ChildRef<NodesC<T>> TierNode[kHashTrieSize];
+    uint16_t            EffectiveNodeCount;
 };
 
+#ifdef HASHTRIE_COMPRESSED_REFS
+const uint32_t kMaxNodesC = kHashTrieSize * kHashTrieSize;
+const uint32_t kMaxNodesD = kHashTrieSize * kHashTrieSize * kHashTrieSize;
+#endif
+
+//  Nodes unlinked by a remove or replaced by compaction, released once
+//  their tier-1 slot has passed a grace period
+template <typename T>
+struct RetiredNodes {
+    int                  idx;
+    NodesB<T>*           NodeB;
+    ChildRef<NodesC<T>>  NodeC;
+    ChildRef<NodesD<T>>  NodeD;
+    char*                Arena;
+    size_t               ArenaSize;
+    NodesB<T>*           Subtree;   //  whole subtree, nodes inside Arena go with it
+};
+
+//  Change notification for every successful update, used by the journal
+enum class TrieChange : uint8_t {
+    ADD = 1,
+    REMOVE,
+    REPLACE
+};
+
+template <typename T>
+class HashTrieChangeSink {
+ public:
+    virtual ~HashTrieChangeSink() {}
+    virtual void Record(TrieChange in_Op, uint32_t in_Key, const T* in_Data) = 0;
+};
+
+template <typename T>
+class HashTrieReadGuard;
+
 template <typename T>
 class HashTrie {
  public:
+    using ReadGuard = HashTrieReadGuard<T>;
+
     virtual ~HashTrie() {
         HashTrieFlushExtended();
     }
     utils::RESULT       HashTrieInitialize(uint8_t coreId = 0);
     utils::RESULT       HashTrieAddNode(uint32_t in_Key, T *in_Data);
     bool                HashTrieRemoveNode(uint32_t in_Key, T** result);
+    bool                HashTrieReplaceNode(uint32_t in_Key, T *in_Data, T** result);
     T*                  HashTrieGetNode(uint32_t in_Key);
+    T*                  HashTrieGetNode(uint32_t in_Key, ReadGuard& in_Guard);
+    bool                HashTrieIsValidKey(uint32_t in_Key);
+    void                HashTrieBeginBatch();
+    void                HashTrieEndBatch();
+    bool                HashTrieEndBatchFor(std::chrono::microseconds in_Timeout);
+    void                HashTrieAbandonBatch();
+    void                HashTrieCompactConfig(uint16_t in_TiersPerStep, uint32_t in_IntervalUsec);
+    int                 HashTrieCompactStep();
+    void                HashTrieSetChangeSink(HashTrieChangeSink<T>* in_Sink);
+#ifdef HASHTRIE_COMPRESSED_REFS
+    utils::RESULT       HashTrieRegisterValueTable(T* in_Table, uint32_t in_Count);
+#endif
 
  private:
+    friend class HashTrieReadGuard<T>;
+
     lock::RCUProtected<NodesB<T>> BaseNodesPtrArr_[kHashTrieSize];
-    uint16_t                      EffectiveNodeCount_;
-    uint8_t                       WorkCore_;
+    uint16_t                      EffectiveNodeCount_ = 0;
+    uint8_t                       WorkCore_ = 0;
+
+    //  Per tier-1 slot block holding a depth-first copy of its subtree
+    char*                         CompactArena_[kHashTrieSize] = {};
+    size_t                        CompactArenaSize_[kHashTrieSize] = {};
+    size_t                        ScatteredBytes_[kHashTrieSize] = {};   //  live nodes off arena
+    size_t                        ArenaDeadBytes_[kHashTrieSize] = {};   //  removed nodes in arena
+    uint16_t                      CompactTiersPerStep_ = kCompactTiersPerStep;
+    std::chrono::microseconds     CompactInterval_{kCompactIntervalUsec};
+    std::chrono::steady_clock::time_point CompactLastStep_;
+    int                           CompactCursor_ = 0;
+    bool                          CompactTrimPending_ = false;  //  trim once the batch reclaims
+
+    //  Between HashTrieBeginBatch/EndBatch, reclamation waits for one grace
+    //  period per touched tier-1 slot at the end of the batch
+    bool                          DeferReclaim_ = false;
+    bool                          BatchDirty_[kHashTrieSize] = {};
+    std::vector<RetiredNodes<T>>  Retired_;
+
+    HashTrieChangeSink<T>*        ChangeSink_ = nullptr;
+
+#ifdef HASHTRIE_COMPRESSED_REFS
+    NodeArena<NodesC<T>, kMaxNodesC> NodeArenaC_;
+    NodeArena<NodesD<T>, kMaxNodesD> NodeArenaD_;
+    T*                            ValueTable_ = nullptr;
+    uint32_t                      ValueTableSize_ = 0;
+#endif
 
     uint8_t       GetTrieKey(uint32_t in_Key, int in_pos);
     uint32_t      Accumulated_Key(int in_key1, int in_key2, int in_key3, int in_key4);
@@ -59,8 +169,100 @@ class HashTrie {
     void          FinalizeReadingNextNode(int idx);
     NodesB<T>*    GetWriteNextNode(int idx);
     void          SyncBeforeUpdateNextNode(int idx);
+    bool          TrySyncBeforeUpdateNextNode(int idx, std::chrono::microseconds timeout);
     NodesB<T>*    UpdateNextNode(NodesB<T>*, int idx);
     void          HashTrieFlushExtended();
+
+    NodesC<T>*    DerefNodeC(ChildRef<NodesC<T>> ref);
+    NodesD<T>*    DerefNodeD(ChildRef<NodesD<T>> ref);
+    T*            DerefData(ChildRef<T> ref);
+    ChildRef<T>   DataRef(T* data);
+    ChildRef<NodesC<T>> NewNodeC();
+    ChildRef<NodesD<T>> NewNodeD();
+
+    bool          InCompactArena(const void* node, int idx);
+    template <typename N>
+    static constexpr size_t CompactNodeSize() {
+        return ((sizeof(N) + utils::kCacheLineSize - 1) / utils::kCacheLineSize) *
+               utils::kCacheLineSize;
+    }
+    template <typename N>
+    void          AccountRetired(const N* node, int idx);
+    static bool   InArena(const void* node, const char* Arena, size_t ArenaSize);
+    template <typename N>
+    void          ReleaseNode(N* node, const char* Arena, size_t ArenaSize);
+    void          ReleaseNodeC(ChildRef<NodesC<T>> ref, const char* Arena, size_t ArenaSize);
+    void          ReleaseNodeD(ChildRef<NodesD<T>> ref, const char* Arena, size_t ArenaSize);
+    void          ReleaseSubtree(NodesB<T>* node, const char* Arena, size_t ArenaSize);
+    void          ReleaseCompactArena(int idx);
+#ifndef HASHTRIE_COMPRESSED_REFS
+    bool          CompactTier(int idx);
+#endif
+#ifdef HASHTRIE_PROFILE
+    T*            GetNodeProfiled(uint8_t Tier1Key, uint8_t Tier2Key,
+                                  uint8_t Tier3Key, uint8_t Tier4Key,
+                                  ReadGuard* in_Guard = nullptr);
+#endif
+    void          RetireNodes(RetiredNodes<T>* retired);
+    void          ReclaimNodes(const RetiredNodes<T>& retired);
+};
+
+/**
+ * Read side section spanning any number of lookups, e.g. one per packet
+ * batch. A tier-1 slot's RCU counter is taken on the first lookup that
+ * touches it and released when the guard closes, so pointers returned by
+ * HashTrieGetNode(key, guard) stay valid until then and repeated lookups in
+ * the same slot cost no atomics.
+ *
+ * Writers on the touched slots wait for the guard: keep it short and never
+ * hold one on the thread that updates the trie.
+ *
+ * Usage
+ *  {
+ *      HashTrie<T>::ReadGuard guard(trie);
+ *      for (each packet) data = trie.HashTrieGetNode(key, guard);
+ *  }
+ */
+template <typename T>
+class HashTrieReadGuard {
+ public:
+    explicit HashTrieReadGuard(HashTrie<T>& trie) : trie_(trie), held_{} {}
+    HashTrieReadGuard(const HashTrieReadGuard&) = delete;
+    HashTrieReadGuard& operator=(const HashTrieReadGuard&) = delete;
+    ~HashTrieReadGuard() {
+        Release();
+    }
+
+    inline T* Get(uint32_t in_Key) {
+        return trie_.HashTrieGetNode(in_Key, *this);
+    }
+
+    //  Closes every section taken so far, the guard can be reused afterwards
+    inline void Release() {
+        for (int w = 0; w < kHeldWords; w++) {
+            while (0 != held_[w]) {
+                int idx = w * 64 + __builtin_ctzll(held_[w]);
+                held_[w] &= held_[w] - 1;
+                trie_.BaseNodesPtrArr_[idx].finalize_reading();
+            }
+        }
+    }
+
+ private:
+    friend class HashTrie<T>;
+    static const int kHeldWords = kHashTrieSize / 64;
+
+    HashTrie<T>& trie_;
+    uint64_t     held_[kHeldWords];
+
+    always_inline NodesB<T>* Enter(int idx) {
+        uint64_t bit = 1ULL << (idx & 63);
+        if (unlikely(0 == (held_[idx >> 6] & bit))) {
+            trie_.BaseNodesPtrArr_[idx].initialize_reading();
+            held_[idx >> 6] |= bit;
+        }
+        return trie_.BaseNodesPtrArr_[idx].get_reading_copy();
+    }
 };
 
 template <typename T>
@@ -88,6 +290,217 @@ void HashTrie<T>::SyncBeforeUpdateNextNode(int idx) {
     BaseNodesPtrArr_[idx].synchronize_writing();
 }
 
+template <typename T>
+bool HashTrie<T>::TrySyncBeforeUpdateNextNode(int idx, std::chrono::microseconds timeout) {
+    if (0 == timeout.count()) {
+        return BaseNodesPtrArr_[idx].poll_synchronize_rcu();
+    }
+    return BaseNodesPtrArr_[idx].try_synchronize_for(timeout);
+}
+
+template <typename T>
+always_inline
+NodesC<T>* HashTrie<T>::DerefNodeC(ChildRef<NodesC<T>> ref) {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    return (0 != ref) ? NodeArenaC_.Get(ref) : nullptr;
+#else
+    return ref;
+#endif
+}
+
+template <typename T>
+always_inline
+NodesD<T>* HashTrie<T>::DerefNodeD(ChildRef<NodesD<T>> ref) {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    return (0 != ref) ? NodeArenaD_.Get(ref) : nullptr;
+#else
+    return ref;
+#endif
+}
+
+template <typename T>
+always_inline
+T* HashTrie<T>::DerefData(ChildRef<T> ref) {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    return (0 != ref) ? ValueTable_ + (ref - 1) : nullptr;
+#else
+    return ref;
+#endif
+}
+
+//  Null ref if the data can not be stored (outside the value table)
+template <typename T>
+always_inline
+ChildRef<T> HashTrie<T>::DataRef(T* data) {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    if (nullptr == data || data < ValueTable_ || data >= ValueTable_ + ValueTableSize_) {
+        return 0;
+    }
+    return static_cast<uint32_t>(data - ValueTable_) + 1;
+#else
+    return data;
+#endif
+}
+
+template <typename T>
+ChildRef<NodesC<T>> HashTrie<T>::NewNodeC() {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    return NodeArenaC_.Alloc();
+#else
+    return new NodesC<T>();
+#endif
+}
+
+template <typename T>
+ChildRef<NodesD<T>> HashTrie<T>::NewNodeD() {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    return NodeArenaD_.Alloc();
+#else
+    return new NodesD<T>();
+#endif
+}
+
+#ifdef HASHTRIE_COMPRESSED_REFS
+template <typename T>
+utils::RESULT HashTrie<T>::HashTrieRegisterValueTable(T* in_Table, uint32_t in_Count) {
+    //  Handles already in the trie would point into the old table
+    if (nullptr == in_Table || 0 == in_Count || 0 != EffectiveNodeCount_) {
+        return utils::RESULT::ERROR;
+    }
+    ValueTable_ = in_Table;
+    ValueTableSize_ = in_Count;
+    return utils::RESULT::OK;
+}
+#endif
+
+template <typename T>
+bool HashTrie<T>::InArena(const void* node, const char* Arena, size_t ArenaSize) {
+    const char* p = static_cast<const char*>(node);
+    return (nullptr != Arena && p >= Arena && p < Arena + ArenaSize);
+}
+
+template <typename T>
+bool HashTrie<T>::InCompactArena(const void* node, int idx) {
+    return InArena(node, CompactArena_[idx], CompactArenaSize_[idx]);
+}
+
+//  Nodes living in a compact arena are released together with the arena
+template <typename T>
+template <typename N>
+void HashTrie<T>::ReleaseNode(N* node, const char* Arena, size_t ArenaSize) {
+    if (nullptr != node && !InArena(node, Arena, ArenaSize)) {
+        delete node;
+    }
+}
+
+template <typename T>
+void HashTrie<T>::ReleaseNodeC(ChildRef<NodesC<T>> ref, const char* Arena, size_t ArenaSize) {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    (void)Arena;
+    (void)ArenaSize;
+    if (0 != ref) {
+        NodeArenaC_.Free(ref);
+    }
+#else
+    ReleaseNode(ref, Arena, ArenaSize);
+#endif
+}
+
+template <typename T>
+void HashTrie<T>::ReleaseNodeD(ChildRef<NodesD<T>> ref, const char* Arena, size_t ArenaSize) {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    (void)Arena;
+    (void)ArenaSize;
+    if (0 != ref) {
+        NodeArenaD_.Free(ref);
+    }
+#else
+    ReleaseNode(ref, Arena, ArenaSize);
+#endif
+}
+
+template <typename T>
+void HashTrie<T>::ReleaseSubtree(NodesB<T>* node, const char* Arena, size_t ArenaSize) {
+    for (int j = 0; j < kHashTrieSize; j++) {
+        NodesC<T> *Tire3 = DerefNodeC(node->TierNode[j]);
+        if (nullptr != Tire3) {
+            for (int k = 0; k < kHashTrieSize; k++) {
+                ReleaseNodeD(Tire3->TierNode[k], Arena, ArenaSize);
+            }
+            ReleaseNodeC(node->TierNode[j], Arena, ArenaSize);
+        }
+    }
+    ReleaseNode(node, Arena, ArenaSize);
+}
+
+template <typename T>
+void HashTrie<T>::ReleaseCompactArena(int idx) {
+    free(CompactArena_[idx]);
+    CompactArena_[idx] = nullptr;
+    CompactArenaSize_[idx] = 0;
+}
+
+//  Keeps the per slot byte counts CompactTier decides on up to date
+template <typename T>
+template <typename N>
+void HashTrie<T>::AccountRetired(const N* node, int idx) {
+    if (nullptr == node) {
+        return;
+    }
+    if (InCompactArena(node, idx)) {
+        ArenaDeadBytes_[idx] += CompactNodeSize<N>();
+    } else {
+        ScatteredBytes_[idx] -= CompactNodeSize<N>();
+    }
+}
+
+//  Takes ownership of the unlinked nodes. Nodes inside the compact arena are
+//  dropped here, the arena itself is handed over once its slot is empty.
+template <typename T>
+void HashTrie<T>::RetireNodes(RetiredNodes<T>* retired) {
+    int idx = retired->idx;
+#ifndef HASHTRIE_COMPRESSED_REFS
+    AccountRetired(retired->NodeD, idx);
+    AccountRetired(retired->NodeC, idx);
+    if (InCompactArena(retired->NodeD, idx)) {
+        retired->NodeD = nullptr;
+    }
+    if (InCompactArena(retired->NodeC, idx)) {
+        retired->NodeC = nullptr;
+    }
+#endif
+    if (nullptr != retired->NodeB) {
+        if (InCompactArena(retired->NodeB, idx)) {
+            retired->NodeB = nullptr;
+        }
+        retired->Arena = CompactArena_[idx];
+        retired->ArenaSize = CompactArenaSize_[idx];
+        CompactArena_[idx] = nullptr;
+        CompactArenaSize_[idx] = 0;
+        ScatteredBytes_[idx] = 0;
+        ArenaDeadBytes_[idx] = 0;
+    }
+
+    if (DeferReclaim_) {
+        BatchDirty_[idx] = true;
+        Retired_.push_back(*retired);
+    } else {
+        SyncBeforeUpdateNextNode(idx);
+        ReclaimNodes(*retired);
+    }
+}
+
+template <typename T>
+void HashTrie<T>::ReclaimNodes(const RetiredNodes<T>& retired) {
+    ReleaseNodeD(retired.NodeD, retired.Arena, retired.ArenaSize);
+    ReleaseNodeC(retired.NodeC, retired.Arena, retired.ArenaSize);
+    delete retired.NodeB;
+    if (nullptr != retired.Subtree) {
+        ReleaseSubtree(retired.Subtree, retired.Arena, retired.ArenaSize);
+    }
+    free(retired.Arena);
+}
+
 template <typename T>
 always_inline
 uint8_t HashTrie<T>::GetTrieKey(uint32_t in_Key, int in_pos) {
@@ -116,6 +529,7 @@ utils::RESULT HashTrie<T>::HashTrieInitialize(uint8_t coreId) {
     WorkCore_ = coreId;
     for (int i = 0 ; i < kHashTrieSize ; i++) {
         BaseNodesPtrArr_[i].setCoreId(coreId);
+        BaseNodesPtrArr_[i].setSlotId(i);
     }
     return utils::RESULT::OK;
 }
@@ -132,6 +546,12 @@ utils::RESULT HashTrie<T>::HashTrieAddNode(uint32_t in_Key, T *in_Data) {
         return utils::RESULT::ERROR;
     }
 
+#ifdef HASHTRIE_COMPRESSED_REFS
+    if (0 == DataRef(in_Data)) {
+        return utils::RESULT::ERROR;
+    }
+#endif
+
     NodesB<T> *TierNode1 = GetReadNextNode(Tier1Key);
     if (nullptr == TierNode1) {
         // allocating memory only
@@ -140,33 +560,49 @@ utils::RESULT HashTrie<T>::HashTrieAddNode(uint32_t in_Key, T *in_Data) {
         // calling constructor
         new (NewTierNode) NodesB<T>();
         EffectiveNodeCount_++;
+#ifndef HASHTRIE_COMPRESSED_REFS
+        ScatteredBytes_[Tier1Key] += CompactNodeSize<NodesB<T>>();
+#endif
         FinalizeReadingNextNode(Tier1Key);
         UpdateNextNode(NewTierNode, Tier1Key);  // called update and not sync_update
         TierNode1 = GetReadNextNode(Tier1Key);
     }
 
-    if (nullptr == TierNode1->TierNode[Tier2Key]) {
-        NodesC<T>* NewNodesCPtr =
-                      reinterpret_cast<NodesC<T> *>(new NodesC<T>);
-        new (NewNodesCPtr) NodesC<T>();
-        TierNode1->TierNode[Tier2Key] = NewNodesCPtr;
+    if (nullptr == DerefNodeC(TierNode1->TierNode[Tier2Key])) {
+        ChildRef<NodesC<T>> NewNodesCRef = NewNodeC();
+        if (nullptr == DerefNodeC(NewNodesCRef)) {
+            FinalizeReadingNextNode(Tier1Key);
+            return utils::RESULT::ERROR;
+        }
+        TierNode1->TierNode[Tier2Key] = NewNodesCRef;
         TierNode1->EffectiveNodeCount++;
+#ifndef HASHTRIE_COMPRESSED_REFS
+        ScatteredBytes_[Tier1Key] += CompactNodeSize<NodesC<T>>();
+#endif
     }
 
-    NodesC<T> *TierNode2 = TierNode1->TierNode[Tier2Key];
-    if (nullptr == TierNode2->TierNode[Tier3Key]) {
-        NodesD<T>* NewNodeDPtr =
-                      reinterpret_cast<NodesD<T> *>(new NodesD<T>);
-        new (NewNodeDPtr) NodesD<T>();
-        TierNode2->TierNode[Tier3Key] = NewNodeDPtr;
+    NodesC<T> *TierNode2 = DerefNodeC(TierNode1->TierNode[Tier2Key]);
+    if (nullptr == DerefNodeD(TierNode2->TierNode[Tier3Key])) {
+        ChildRef<NodesD<T>> NewNodeDRef = NewNodeD();
+        if (nullptr == DerefNodeD(NewNodeDRef)) {
+            FinalizeReadingNextNode(Tier1Key);
+            return utils::RESULT::ERROR;
+        }
+        TierNode2->TierNode[Tier3Key] = NewNodeDRef;
         TierNode2->EffectiveNodeCount++;
+#ifndef HASHTRIE_COMPRESSED_REFS
+        ScatteredBytes_[Tier1Key] += CompactNodeSize<NodesD<T>>();
+#endif
     }
 
-    NodesD<T> *TierNode3 = TierNode2->TierNode[Tier3Key];
-    if (nullptr == TierNode3->dataPtr[Tier4Key]) {
-        TierNode3->dataPtr[Tier4Key] = in_Data;
+    NodesD<T> *TierNode3 = DerefNodeD(TierNode2->TierNode[Tier3Key]);
+    if (nullptr == DerefData(TierNode3->dataPtr[Tier4Key])) {
+        TierNode3->dataPtr[Tier4Key] = DataRef(in_Data);
         TierNode3->EffectiveNodeCount++;
         FinalizeReadingNextNode(Tier1Key);
+        if (unlikely(nullptr != ChangeSink_)) {
+            ChangeSink_->Record(TrieChange::ADD, in_Key, in_Data);
+        }
         return utils::RESULT::OK;
     }
     FinalizeReadingNextNode(Tier1Key);
@@ -187,6 +623,12 @@ T* HashTrie<T>::HashTrieGetNode(uint32_t in_Key) {
         return ret;
     }
 
+#ifdef HASHTRIE_PROFILE
+    if (unlikely(perf::SampleThisLookup())) {
+        return GetNodeProfiled(Tier1Key, Tier2Key, Tier3Key, Tier4Key);
+    }
+#endif
+
     NodesB<T> *Tire2 = nullptr;
     NodesC<T> *Tire3 = nullptr;
     NodesD<T> *Tire4 = nullptr;
@@ -195,11 +637,11 @@ T* HashTrie<T>::HashTrieGetNode(uint32_t in_Key) {
     Tire2 = GetReadNextNode(Tier1Key);
 
     if (nullptr != Tire2) {
-        Tire3 = Tire2->TierNode[Tier2Key];
+        Tire3 = DerefNodeC(Tire2->TierNode[Tier2Key]);
         if (nullptr != Tire3) {
-            Tire4 = Tire3->TierNode[Tier3Key];
+            Tire4 = DerefNodeD(Tire3->TierNode[Tier3Key]);
             if (nullptr != Tire4) {
-                ret = Tire4->dataPtr[Tier4Key];
+                ret = DerefData(Tire4->dataPtr[Tier4Key]);
             }
         }
     }
@@ -207,6 +649,82 @@ T* HashTrie<T>::HashTrieGetNode(uint32_t in_Key) {
     return ret;
 }
 
+template <typename T>
+T* HashTrie<T>::HashTrieGetNode(uint32_t in_Key, ReadGuard& in_Guard) {
+    uint8_t Tier1Key = GetTrieKey(in_Key, 1);
+    uint8_t Tier2Key = GetTrieKey(in_Key, 2);
+    uint8_t Tier3Key = GetTrieKey(in_Key, 3);
+    uint8_t Tier4Key = GetTrieKey(in_Key, 4);
+
+    if ((kHashTrieSize-1) == Tier1Key || (kHashTrieSize-1) == Tier2Key ||
+        (kHashTrieSize-1) == Tier3Key || (kHashTrieSize-1) == Tier4Key) {
+        return nullptr;
+    }
+
+#ifdef HASHTRIE_PROFILE
+    if (unlikely(perf::SampleThisLookup())) {
+        return GetNodeProfiled(Tier1Key, Tier2Key, Tier3Key, Tier4Key, &in_Guard);
+    }
+#endif
+
+    NodesB<T> *Tire2 = in_Guard.Enter(Tier1Key);
+    if (nullptr != Tire2) {
+        NodesC<T> *Tire3 = DerefNodeC(Tire2->TierNode[Tier2Key]);
+        if (nullptr != Tire3) {
+            NodesD<T> *Tire4 = DerefNodeD(Tire3->TierNode[Tier3Key]);
+            if (nullptr != Tire4) {
+                return DerefData(Tire4->dataPtr[Tier4Key]);
+            }
+        }
+    }
+    return nullptr;
+}
+
+#ifdef HASHTRIE_PROFILE
+//  Same walk as HashTrieGetNode with an ordered cycle read after every tier,
+//  so a cache or TLB miss shows up against the tier whose node it hit.
+//  With a guard, tier 1 is the guard's Enter and there is no unlock.
+template <typename T>
+never_inline
+T* HashTrie<T>::GetNodeProfiled(uint8_t Tier1Key, uint8_t Tier2Key,
+                                uint8_t Tier3Key, uint8_t Tier4Key,
+                                ReadGuard* in_Guard) {
+    perf::TierProfile& prof = perf::ThreadTierProfile();
+    T *ret = nullptr;
+
+    uint64_t t0 = utils::read_cycles_ordered();
+    NodesB<T> *Tire2 = (nullptr != in_Guard) ? in_Guard->Enter(Tier1Key) : GetReadNextNode(Tier1Key);
+    uint64_t t1 = utils::read_cycles_ordered();
+    prof.cycles[0] += t1 - t0;
+    prof.tier_samples[0]++;
+    if (nullptr != Tire2) {
+        NodesC<T> *Tire3 = DerefNodeC(Tire2->TierNode[Tier2Key]);
+        uint64_t t2 = utils::read_cycles_ordered();
+        prof.cycles[1] += t2 - t1;
+        prof.tier_samples[1]++;
+        if (nullptr != Tire3) {
+            NodesD<T> *Tire4 = DerefNodeD(Tire3->TierNode[Tier3Key]);
+            uint64_t t3 = utils::read_cycles_ordered();
+            prof.cycles[2] += t3 - t2;
+            prof.tier_samples[2]++;
+            if (nullptr != Tire4) {
+                ret = DerefData(Tire4->dataPtr[Tier4Key]);
+                prof.cycles[3] += utils::read_cycles_ordered() - t3;
+                prof.tier_samples[3]++;
+            }
+        }
+    }
+    if (nullptr == in_Guard) {
+        uint64_t t4 = utils::read_cycles_ordered();
+        FinalizeReadingNextNode(Tier1Key);
+        prof.unlock_cycles += utils::read_cycles_ordered() - t4;
+        prof.unlock_samples++;
+    }
+    prof.samples++;
+    return ret;
+}
+#endif
+
 template <typename T>
 bool HashTrie<T>::HashTrieRemoveNode(uint32_t in_Key, T** result) {
     if (result == nullptr) {
@@ -229,11 +747,11 @@ bool HashTrie<T>::HashTrieRemoveNode(uint32_t in_Key, T** result) {
     NodesB<T> *Tire2 = GetReadNextNode(Tier1Key);
 
     if (nullptr != Tire2) {
-        NodesC<T> *Tire3 = Tire2->TierNode[Tier2Key];
+        NodesC<T> *Tire3 = DerefNodeC(Tire2->TierNode[Tier2Key]);
         if (nullptr != Tire3) {
-            NodesD<T> *Tire4 = Tire3->TierNode[Tier3Key];
+            NodesD<T> *Tire4 = DerefNodeD(Tire3->TierNode[Tier3Key]);
             if (nullptr != Tire4) {
-                pData = Tire4->dataPtr[Tier4Key];
+                pData = DerefData(Tire4->dataPtr[Tier4Key]);
             }
         }
     }
@@ -242,86 +760,283 @@ bool HashTrie<T>::HashTrieRemoveNode(uint32_t in_Key, T** result) {
 
     if (nullptr != pData) {
         NodesB<T> *Tire2 = GetWriteNextNode(Tier1Key);
-        NodesC<T> *Tire3 = Tire2->TierNode[Tier2Key];
-        NodesD<T> *Tire4 = Tire3->TierNode[Tier3Key];
+        NodesC<T> *Tire3 = DerefNodeC(Tire2->TierNode[Tier2Key]);
+        NodesD<T> *Tire4 = DerefNodeD(Tire3->TierNode[Tier3Key]);
+        RetiredNodes<T> Retired = {Tier1Key, nullptr, {}, {}, nullptr, 0, nullptr};
 
-        *result = Tire4->dataPtr[Tier4Key];
+        *result = DerefData(Tire4->dataPtr[Tier4Key]);
+        Tire4->dataPtr[Tier4Key] = {};
         Tire4->EffectiveNodeCount--;
         if (0 == Tire4->EffectiveNodeCount) {
-            Tire3->TierNode[Tier3Key] = nullptr;
+            Retired.NodeD = Tire3->TierNode[Tier3Key];
+            Tire3->TierNode[Tier3Key] = {};
             Tire3->EffectiveNodeCount--;
-        } else {
-            Tire4 = nullptr;  //  No need to delete Tire4
         }
 
         if (0 == Tire3->EffectiveNodeCount) {
-            Tire2->TierNode[Tier2Key] = nullptr;
+            Retired.NodeC = Tire2->TierNode[Tier2Key];
+            Tire2->TierNode[Tier2Key] = {};
             Tire2->EffectiveNodeCount--;
-        } else {
-            Tire3 = nullptr;  //  No need to delete Tire3
         }
-        NodesB<T> *OldTire2 = nullptr;
 
         if (0 == Tire2->EffectiveNodeCount) {
             EffectiveNodeCount_--;
-            OldTire2 = UpdateNextNode(nullptr, Tier1Key);
+            Retired.NodeB = UpdateNextNode(nullptr, Tier1Key);
+        }
+
+        RetireNodes(&Retired);
+        if (unlikely(nullptr != ChangeSink_)) {
+            ChangeSink_->Record(TrieChange::REMOVE, in_Key, nullptr);
         }
+        return true;
+    }
+    return false;
+}
+
+template <typename T>
+bool HashTrie<T>::HashTrieReplaceNode(uint32_t in_Key, T *in_Data, T** result) {
+    if (result == nullptr || in_Data == nullptr) {
+        printf("Failed to replace key in Hash table.\n");
+        return false;
+    }
+
+    uint8_t Tier1Key = GetTrieKey(in_Key, 1);
+    uint8_t Tier2Key = GetTrieKey(in_Key, 2);
+    uint8_t Tier3Key = GetTrieKey(in_Key, 3);
+    uint8_t Tier4Key = GetTrieKey(in_Key, 4);
 
+    if ((kHashTrieSize-1) == Tier1Key || (kHashTrieSize-1) == Tier2Key ||
+        (kHashTrieSize-1) == Tier3Key || (kHashTrieSize-1) == Tier4Key) {
+        return false;
+    }
+
+    ChildRef<T> DataRefNew = DataRef(in_Data);
+    if (nullptr == DerefData(DataRefNew)) {
+        return false;
+    }
+
+    NodesB<T> *Tire2 = GetWriteNextNode(Tier1Key);
+    if (nullptr == Tire2 || nullptr == DerefNodeC(Tire2->TierNode[Tier2Key])) {
+        return false;
+    }
+    NodesD<T> *Tire4 = DerefNodeD(DerefNodeC(Tire2->TierNode[Tier2Key])->TierNode[Tier3Key]);
+    if (nullptr == Tire4 || nullptr == DerefData(Tire4->dataPtr[Tier4Key])) {
+        return false;
+    }
+
+    *result = DerefData(Tire4->dataPtr[Tier4Key]);
+    Tire4->dataPtr[Tier4Key] = DataRefNew;
+    if (unlikely(nullptr != ChangeSink_)) {
+        ChangeSink_->Record(TrieChange::REPLACE, in_Key, in_Data);
+    }
+    //  Old data may only be released by the caller after the grace period
+    if (DeferReclaim_) {
+        BatchDirty_[Tier1Key] = true;
+    } else {
         SyncBeforeUpdateNextNode(Tier1Key);
+    }
+    return true;
+}
 
-        if (nullptr != OldTire2) {
-            if (nullptr != OldTire2) {
-                delete OldTire2;
-            }
-        }
+template <typename T>
+bool HashTrie<T>::HashTrieIsValidKey(uint32_t in_Key) {
+    return ((kHashTrieSize-1) != GetTrieKey(in_Key, 1) && (kHashTrieSize-1) != GetTrieKey(in_Key, 2) &&
+            (kHashTrieSize-1) != GetTrieKey(in_Key, 3) && (kHashTrieSize-1) != GetTrieKey(in_Key, 4));
+}
 
-        if (nullptr != Tire4) {
-           delete Tire4;
-        }
+template <typename T>
+void HashTrie<T>::HashTrieBeginBatch() {
+    DeferReclaim_ = true;
+}
 
-        if (nullptr != Tire3) {
-           delete Tire3;
+template <typename T>
+void HashTrie<T>::HashTrieEndBatch() {
+    for (int i = 0; i < kHashTrieSize; i++) {
+        if (BatchDirty_[i]) {
+            SyncBeforeUpdateNextNode(i);
+            BatchDirty_[i] = false;
         }
+    }
+    for (const RetiredNodes<T>& retired : Retired_) {
+        ReclaimNodes(retired);
+    }
+    Retired_.clear();
+    DeferReclaim_ = false;
+#ifdef __GLIBC__
+    if (CompactTrimPending_) {
+        malloc_trim(0);
+    }
+#endif
+    CompactTrimPending_ = false;
+}
 
-        return true;
+//  Bounded variant of HashTrieEndBatch: returns false if some slot is still
+//  in its grace period after in_Timeout (0 only polls). The batch then stays
+//  open, the caller may keep updating and call again later.
+template <typename T>
+bool HashTrie<T>::HashTrieEndBatchFor(std::chrono::microseconds in_Timeout) {
+    std::chrono::steady_clock::time_point Deadline = std::chrono::steady_clock::now() + in_Timeout;
+    for (int i = 0; i < kHashTrieSize; i++) {
+        if (BatchDirty_[i]) {
+            std::chrono::microseconds Left = std::chrono::duration_cast<std::chrono::microseconds>(
+                    Deadline - std::chrono::steady_clock::now());
+            if (!TrySyncBeforeUpdateNextNode(i, std::max(Left, std::chrono::microseconds(0)))) {
+                return false;
+            }
+            BatchDirty_[i] = false;
+        }
     }
-    return false;
+    HashTrieEndBatch();
+    return true;
+}
+
+//  Leaves batch mode without waiting, for a writer that gives up on a grace
+//  period held by a stuck reader. Later updates synchronize again as outside
+//  a batch. Nodes retired so far stay queued until the next
+//  HashTrieEndBatch or the destructor, which wait for their grace periods.
+template <typename T>
+void HashTrie<T>::HashTrieAbandonBatch() {
+    DeferReclaim_ = false;
 }
 
 template <typename T>
 void HashTrie<T>::HashTrieFlushExtended() {
+    if (DeferReclaim_ || !Retired_.empty()) {
+        HashTrieEndBatch();
+    }
     for (int i = 0; i < kHashTrieSize; i++) {
         NodesB<T> *Tire2 = GetWriteNextNode(i);
         if (nullptr != Tire2) {
-            for (int j = 0; j < kHashTrieSize; j++) {
-                if (nullptr != Tire2->TierNode[j]) {
-                    NodesC<T> *Tire3 = Tire2->TierNode[j];
-                    for (int k = 0; k < kHashTrieSize; k++) {
-                        if (nullptr != Tire3->TierNode[k]) {
-                            NodesD<T> *Tire4 = Tire3->TierNode[k];
-                            for (k = 0; k < kHashTrieSize; k++) {
-                                Tire4->dataPtr[k] = nullptr;
-                            }
-                            Tire4->EffectiveNodeCount = 0;
-                            SyncBeforeUpdateNextNode(i);
-                            delete Tire4;
-                        }
-                        Tire3->TierNode[k] = nullptr;
-                    }
-                    Tire3->EffectiveNodeCount = 0;
-                    SyncBeforeUpdateNextNode(i);
-                    delete Tire3;
-                }
-                Tire2->TierNode[j] = nullptr;
-            }
-            Tire2->EffectiveNodeCount = 0;
-            NodesB<T> * oldTire2 = UpdateNextNode(nullptr, i);
+            UpdateNextNode(nullptr, i);
             SyncBeforeUpdateNextNode(i);
-            delete oldTire2;
+            ReleaseSubtree(Tire2, CompactArena_[i], CompactArenaSize_[i]);
+            ReleaseCompactArena(i);
+            ScatteredBytes_[i] = 0;
+            ArenaDeadBytes_[i] = 0;
         }
     }
     EffectiveNodeCount_ = 0;
 }
+
+template <typename T>
+void HashTrie<T>::HashTrieSetChangeSink(HashTrieChangeSink<T>* in_Sink) {
+    ChangeSink_ = in_Sink;
+}
+
+template <typename T>
+void HashTrie<T>::HashTrieCompactConfig(uint16_t in_TiersPerStep, uint32_t in_IntervalUsec) {
+    CompactTiersPerStep_ = in_TiersPerStep;
+    CompactInterval_ = std::chrono::microseconds(in_IntervalUsec);
+}
+
+#ifndef HASHTRIE_COMPRESSED_REFS
+//  Copies one tier-1 subtree into a single block in depth-first order
+//  (B, C0, D0.., C1, D1..) and publishes it with one grace period.
+//  Returns false if the slot is empty or compact enough: less than
+//  kCompactScatteredPct of its live node bytes allocated off the arena and
+//  less than kCompactDeadPct of the arena taken by removed nodes.
+template <typename T>
+bool HashTrie<T>::CompactTier(int idx) {
+    NodesB<T> *OldTire2 = GetWriteNextNode(idx);
+    if (nullptr == OldTire2) {
+        return false;
+    }
+
+    const size_t kSizeB = CompactNodeSize<NodesB<T>>();
+    const size_t kSizeC = CompactNodeSize<NodesC<T>>();
+    const size_t kSizeD = CompactNodeSize<NodesD<T>>();
+
+    size_t Live = ScatteredBytes_[idx] + CompactArenaSize_[idx] - ArenaDeadBytes_[idx];
+    if (ScatteredBytes_[idx] * 100 <= Live * kCompactScatteredPct &&
+        ArenaDeadBytes_[idx] * 100 <= CompactArenaSize_[idx] * kCompactDeadPct) {
+        return false;
+    }
+
+    size_t Size = kSizeB;
+    for (int j = 0; j < kHashTrieSize; j++) {
+        NodesC<T> *Tire3 = OldTire2->TierNode[j];
+        if (nullptr != Tire3) {
+            Size += kSizeC;
+            for (int k = 0; k < kHashTrieSize; k++) {
+                if (nullptr != Tire3->TierNode[k]) {
+                    Size += kSizeD;
+                }
+            }
+        }
+    }
+
+    char* Arena = static_cast<char*>(aligned_alloc(utils::kCacheLineSize, Size));
+    if (nullptr == Arena) {
+        return false;
+    }
+    char* Cursor = Arena;
+    NodesB<T> *NewTire2 = new (Cursor) NodesB<T>(*OldTire2);
+    Cursor += kSizeB;
+    for (int j = 0; j < kHashTrieSize; j++) {
+        NodesC<T> *Tire3 = OldTire2->TierNode[j];
+        if (nullptr != Tire3) {
+            NodesC<T> *NewTire3 = new (Cursor) NodesC<T>(*Tire3);
+            Cursor += kSizeC;
+            NewTire2->TierNode[j] = NewTire3;
+            for (int k = 0; k < kHashTrieSize; k++) {
+                if (nullptr != Tire3->TierNode[k]) {
+                    NewTire3->TierNode[k] = new (Cursor) NodesD<T>(*Tire3->TierNode[k]);
+                    Cursor += kSizeD;
+                }
+            }
+        }
+    }
+
+    //  Within a batch the old subtree is reclaimed at its end, so a writer
+    //  loop driving compaction does not block on this grace period
+    UpdateNextNode(NewTire2, idx);
+    RetiredNodes<T> Retired = {idx, nullptr, {}, {}, CompactArena_[idx], CompactArenaSize_[idx],
+                               OldTire2};
+    CompactArena_[idx] = Arena;
+    CompactArenaSize_[idx] = Size;
+    ScatteredBytes_[idx] = 0;
+    ArenaDeadBytes_[idx] = 0;
+    RetireNodes(&Retired);
+    return true;
+}
+#endif
+
+//  Incremental compaction, to be driven from the writer core's loop like the
+//  other update calls (HashTrieUpdater does so with SetCompaction). Relays
+//  out at most CompactTiersPerStep_ scattered subtrees and does nothing if
+//  called again within CompactInterval_. Inside a batch the replaced
+//  subtrees are released by HashTrieEndBatch instead of waiting here.
+//  With HASHTRIE_COMPRESSED_REFS nodes already come from dense per tier
+//  arenas that reuse freed slots, so there is nothing to relay out.
+template <typename T>
+int HashTrie<T>::HashTrieCompactStep() {
+#ifdef HASHTRIE_COMPRESSED_REFS
+    return 0;
+#else
+    std::chrono::steady_clock::time_point Now = std::chrono::steady_clock::now();
+    if (Now - CompactLastStep_ < CompactInterval_) {
+        return 0;
+    }
+    CompactLastStep_ = Now;
+
+    int Compacted = 0;
+    for (int i = 0; i < kHashTrieSize && Compacted < CompactTiersPerStep_; i++) {
+        int idx = CompactCursor_;
+        CompactCursor_ = (CompactCursor_ + 1) % kHashTrieSize;
+        if (CompactTier(idx)) {
+            Compacted++;
+        }
+    }
+    if (Compacted > 0 && DeferReclaim_) {
+        CompactTrimPending_ = true;
+    } else if (Compacted > 0) {
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+    }
+    return Compacted;
+#endif
+}
 }  //  namespace hash
 
 
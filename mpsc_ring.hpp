@@ -0,0 +1,84 @@
+#ifndef USERPLANE_MPSC_RING_HPP_
+#define USERPLANE_MPSC_RING_HPP_
+
+/**
+ * Bounded lock free multi producer / single consumer ring.
+ *
+ * Every cell carries a sequence number: producers claim a slot with a CAS on
+ * the tail and publish it by bumping the cell sequence, the consumer owns the
+ * head and frees a cell by advancing its sequence by the ring size.
+ */
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.hpp"
+
+namespace lock {
+
+template <typename E, uint32_t kSize>
+class MPSCRing {
+    static_assert(kSize >= 2 && ((kSize - 1) & kSize) == 0, "size should be power of 2");
+
+ public:
+    MPSCRing() : head_(0), tail_(0) {
+        for (uint32_t i = 0; i < kSize; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    //  Any thread. Returns false if the ring is full.
+    inline bool enqueue(const E& elem) {
+        uint64_t pos = tail_.load(std::memory_order_relaxed);
+        while (1) {
+            Cell* cell = &cells_[pos & (kSize - 1)];
+            uint64_t seq = cell->seq.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+            if (0 == diff) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell->elem = elem;
+                    cell->seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //  Consumer thread only. Returns false if the ring is empty.
+    inline bool dequeue(E* elem) {
+        Cell* cell = &cells_[head_ & (kSize - 1)];
+        uint64_t seq = cell->seq.load(std::memory_order_acquire);
+        if (seq != head_ + 1) {
+            return false;
+        }
+        *elem = cell->elem;
+        cell->seq.store(head_ + kSize, std::memory_order_release);
+        head_++;
+        return true;
+    }
+
+    //  Consumer thread only. Dequeues up to max elements, returns the count.
+    inline uint32_t dequeue_burst(E* elems, uint32_t max) {
+        uint32_t n = 0;
+        while (n < max && dequeue(&elems[n])) {
+            n++;
+        }
+        return n;
+    }
+
+ private:
+    struct Cell {
+        std::atomic<uint64_t> seq;
+        E                     elem;
+    };
+
+    alignas(utils::kCacheLineSize) Cell                  cells_[kSize];
+    alignas(utils::kCacheLineSize) uint64_t              head_;
+    alignas(utils::kCacheLineSize) std::atomic<uint64_t> tail_;
+};
+}  //  namespace lock
+#endif  // USERPLANE_MPSC_RING_HPP_
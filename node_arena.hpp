@@ -0,0 +1,80 @@
+#ifndef USERPLANE_NODE_ARENA_HPP_
+#define USERPLANE_NODE_ARENA_HPP_
+
+/**
+ * Per tier node arena addressed by 32-bit indices, used by the trie in
+ * HASHTRIE_COMPRESSED_REFS mode.
+ *
+ * Nodes live in fixed size chunks that are never moved or freed while the
+ * arena exists, so readers can turn an index into a pointer without locking.
+ * Index 0 is reserved as null. Freed indices are reused, so the writer must
+ * only call Free after the grace period of the node's tier-1 slot.
+ */
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "common.hpp"
+
+namespace hash {
+const uint32_t kNodeArenaChunkShift = 10;   /* 1024 nodes per chunk */
+
+template <typename N, uint32_t kMaxNodes>
+class NodeArena {
+ public:
+    NodeArena() : chunks_{}, next_(1) {}
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+    virtual ~NodeArena() {
+        for (uint32_t i = 0; i < kMaxChunks; i++) {
+            free(chunks_[i]);
+        }
+    }
+
+    always_inline N* Get(uint32_t idx) {
+        return chunks_[idx >> kNodeArenaChunkShift] + (idx & (kChunkNodes - 1));
+    }
+
+    //  Returns the index of a zeroed node, 0 if the arena is exhausted
+    uint32_t Alloc() {
+        uint32_t idx;
+        if (!free_.empty()) {
+            idx = free_.back();
+            free_.pop_back();
+        } else {
+            if (next_ > kMaxNodes) {
+                return 0;
+            }
+            idx = next_;
+            uint32_t chunk = idx >> kNodeArenaChunkShift;
+            if (nullptr == chunks_[chunk]) {
+                chunks_[chunk] = static_cast<N*>(aligned_alloc(utils::kCacheLineSize,
+                                                               kChunkBytes));
+                if (nullptr == chunks_[chunk]) {
+                    return 0;
+                }
+            }
+            next_++;
+        }
+        new (Get(idx)) N();
+        return idx;
+    }
+
+    void Free(uint32_t idx) {
+        free_.push_back(idx);
+    }
+
+ private:
+    static const uint32_t kChunkNodes = 1u << kNodeArenaChunkShift;
+    static const uint32_t kMaxChunks = (kMaxNodes >> kNodeArenaChunkShift) + 1;
+    //  aligned_alloc wants a multiple of the alignment
+    static const size_t kChunkBytes = ((kChunkNodes * sizeof(N) + utils::kCacheLineSize - 1) /
+                                       utils::kCacheLineSize) * utils::kCacheLineSize;
+
+    N*                    chunks_[kMaxChunks];
+    uint32_t              next_;
+    std::vector<uint32_t> free_;
+};
+}  //  namespace hash
+#endif  // USERPLANE_NODE_ARENA_HPP_
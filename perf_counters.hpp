@@ -0,0 +1,212 @@
+#ifndef USERPLANE_PERF_COUNTERS_HPP_
+#define USERPLANE_PERF_COUNTERS_HPP_
+
+/**
+ * Hardware counter profiling for the trie lookup/update paths.
+ *
+ * PerfCounters wraps Linux perf_event_open for the calling thread and reports
+ * counts per operation around a batch of calls. TierProfile collects sampled
+ * per tier timings from HashTrieGetNode when built with HASHTRIE_PROFILE.
+ *
+ * Usage
+ *  perf::PerfCounters counters;
+ *  counters.Start();
+ *  ... n x HashTrieGetNode ...
+ *  counters.Stop();
+ *  counters.Report("lookup", n);
+ */
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "common.hpp"
+
+namespace perf {
+const int kTierCount = 4;
+const uint32_t kProfileSampleRate = 64;   /* Time one lookup out of every N */
+
+enum PerfEvent {
+    kCycles = 0,
+    kInstructions,
+    kL1DMisses,
+    kLLCMisses,
+    kDTLBMisses,
+    kBranchMisses,
+    kPerfEventCount
+};
+
+class PerfCounters {
+ public:
+    PerfCounters() {
+        for (int i = 0; i < kPerfEventCount; i++) {
+            fd_[i] = Open(i);
+            value_[i] = 0;
+        }
+    }
+    virtual ~PerfCounters() {
+        for (int i = 0; i < kPerfEventCount; i++) {
+            if (fd_[i] >= 0) {
+                close(fd_[i]);
+            }
+        }
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    inline void Start() {
+        for (int i = 0; i < kPerfEventCount; i++) {
+            if (fd_[i] >= 0) {
+                ioctl(fd_[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd_[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    inline void Stop() {
+        for (int i = 0; i < kPerfEventCount; i++) {
+            if (fd_[i] >= 0) {
+                ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+        for (int i = 0; i < kPerfEventCount; i++) {
+            value_[i] = Read(i);
+        }
+    }
+
+    //  Scaled for multiplexing, -1 if the event is not available
+    inline double Value(int event) const {
+        return value_[event];
+    }
+
+    void Report(const char* label, uint64_t ops) const {
+        static const char* kNames[kPerfEventCount] = {
+            "cycles", "instructions", "L1D-misses", "LLC-misses", "dTLB-misses", "branch-misses"
+        };
+        printf("%s: %lu ops\n", label, static_cast<unsigned long>(ops));
+        for (int i = 0; i < kPerfEventCount; i++) {
+            if (value_[i] < 0 || 0 == ops) {
+                printf("  %-14s %12s\n", kNames[i], "n/a");
+            } else {
+                printf("  %-14s %12.3f /op\n", kNames[i], value_[i] / ops);
+            }
+        }
+        if (value_[kCycles] > 0 && value_[kInstructions] >= 0) {
+            printf("  %-14s %12.3f\n", "IPC", value_[kInstructions] / value_[kCycles]);
+        }
+    }
+
+ private:
+    int    fd_[kPerfEventCount];
+    double value_[kPerfEventCount];
+
+    static uint64_t CacheConfig(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    static int Open(int event) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        switch (event) {
+            case kCycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case kInstructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case kL1DMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = CacheConfig(PERF_COUNT_HW_CACHE_L1D);
+                break;
+            case kLLCMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = CacheConfig(PERF_COUNT_HW_CACHE_LL);
+                break;
+            case kDTLBMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = CacheConfig(PERF_COUNT_HW_CACHE_DTLB);
+                break;
+            case kBranchMisses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+        }
+        //  This thread, any cpu
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    double Read(int event) const {
+        uint64_t buf[3];  //  value, time enabled, time running
+        if (fd_[event] < 0 || sizeof(buf) != read(fd_[event], buf, sizeof(buf))) {
+            return -1;
+        }
+        if (0 == buf[2]) {
+            return 0;
+        }
+        return static_cast<double>(buf[0]) * buf[1] / buf[2];
+    }
+};
+
+//  Sampled per tier timing of HashTrieGetNode on the calling thread.
+//  Tier 1 covers the RCU read lock (or ReadGuard entry) and the base slot
+//  load, tiers 2-4 one pointer dereference each. Lookups that miss stop
+//  early, so every tier is averaged over the samples that reached it.
+struct TierProfile {
+    uint64_t calls;
+    uint64_t samples;
+    uint64_t tier_samples[kTierCount];
+    uint64_t cycles[kTierCount];
+    uint64_t unlock_samples;   //  lookups without a ReadGuard
+    uint64_t unlock_cycles;
+
+    void Reset() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    void Report(const char* label) const {
+        printf("%s: %lu sampled lookups (1/%u)\n", label,
+               static_cast<unsigned long>(samples), kProfileSampleRate);
+        if (0 == samples) {
+            return;
+        }
+        for (int i = 0; i < kTierCount; i++) {
+            if (0 == tier_samples[i]) {
+                printf("  tier%d          %12s\n", i + 1, "n/a");
+                continue;
+            }
+            printf("  tier%d          %12.1f cycles  (%lu samples)\n", i + 1,
+                   static_cast<double>(cycles[i]) / tier_samples[i],
+                   static_cast<unsigned long>(tier_samples[i]));
+        }
+        if (0 == unlock_samples) {
+            printf("  rcu unlock     %12s\n", "n/a");
+            return;
+        }
+        printf("  rcu unlock     %12.1f cycles  (%lu samples)\n",
+               static_cast<double>(unlock_cycles) / unlock_samples,
+               static_cast<unsigned long>(unlock_samples));
+    }
+};
+
+always_static_inline TierProfile& ThreadTierProfile() {
+    static thread_local TierProfile profile = {};
+    return profile;
+}
+
+always_static_inline bool SampleThisLookup() {
+    return 0 == (++ThreadTierProfile().calls % kProfileSampleRate);
+}
+}  //  namespace perf
+#endif  // USERPLANE_PERF_COUNTERS_HPP_
@@ -0,0 +1,345 @@
+#ifndef USERPLANE_TRIE_JOURNAL_HPP_
+#define USERPLANE_TRIE_JOURNAL_HPP_
+
+/**
+ * Change journal for HashTrie.
+ *
+ * Once attached with HashTrieSetChangeSink, every successful add, remove and
+ * replace is written as a fixed size, sequence numbered binary record to a
+ * file or pipe. A standby replays the records into its own trie and can
+ * later resume from the last sequence number it applied instead of
+ * reloading the full table.
+ *
+ * Values are carried as 64-bit payloads produced by a JournalCodec, the
+ * default one copies trivially copyable values of up to 8 bytes. With
+ * HASHTRIE_COMPRESSED_REFS the trie only accepts values from its registered
+ * table, so there is no default codec: pass ValueTableJournalCodec, which
+ * journals table indices, or one of your own.
+ *
+ * Ownership on the standby: Replay hands every value a record removes or
+ * replaces to codec.release, including values the standby loaded itself
+ * before replaying. So release must match how all values in the standby
+ * trie were allocated (new T for DefaultJournalCodec). Leave release empty
+ * if the caller keeps ownership of the values it loaded.
+ *
+ * Usage (active)
+ *  hash::HashTrieJournal<T> journal;
+ *  journal.Open("/var/run/up/trie.journal");
+ *  trie.HashTrieSetChangeSink(&journal);
+ *
+ * Usage (standby)
+ *  last = journal.Replay(fp, trie, last);
+ */
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#include "common.hpp"
+#include "mbit_trie.hpp"
+
+namespace hash {
+const uint32_t kJournalFlushRecords = 1;   /* Flush to the file/pipe every N records */
+
+struct PACKED(JournalRecord {
+    uint64_t seq;
+    uint64_t value;
+    uint32_t key;
+    uint8_t  op;
+});
+
+//  decode returns nullptr for a payload it cannot map, release may be empty
+template <typename T>
+struct JournalCodec {
+    std::function<uint64_t(const T*)> encode;
+    std::function<T*(uint64_t)>       decode;
+    std::function<void(T*)>           release;
+};
+
+//  Decodes into new T and releases with delete, values loaded into a standby
+//  trie by other means must be allocated the same way
+template <typename T>
+struct DefaultJournalCodec {
+    static_assert(std::is_trivially_copyable<T>::value && sizeof(T) <= sizeof(uint64_t),
+                  "provide a JournalCodec for this type");
+
+    static uint64_t Encode(const T* in_Data) {
+        uint64_t value = 0;
+        memcpy(&value, in_Data, sizeof(T));
+        return value;
+    }
+    static T* Decode(uint64_t in_Value) {
+        T* data = new T;
+        memcpy(data, &in_Value, sizeof(T));
+        return data;
+    }
+    static void Release(T* in_Data) {
+        delete in_Data;
+    }
+    static JournalCodec<T> Codec() {
+        return {Encode, Decode, Release};
+    }
+};
+
+//  Journals values as indices into a fixed table, e.g. the one registered
+//  with HashTrieRegisterValueTable. The table owns the values, nothing is
+//  released.
+template <typename T>
+struct ValueTableJournalCodec {
+    static JournalCodec<T> Codec(T* in_Table, uint32_t in_Count) {
+        return {
+            [in_Table](const T* in_Data) -> uint64_t {
+                return static_cast<uint64_t>(in_Data - in_Table);
+            },
+            [in_Table, in_Count](uint64_t in_Value) -> T* {
+                return (in_Value < in_Count) ? in_Table + in_Value : nullptr;
+            },
+            nullptr
+        };
+    }
+};
+
+template <typename T>
+class HashTrieJournal : public HashTrieChangeSink<T> {
+ public:
+#ifdef HASHTRIE_COMPRESSED_REFS
+    explicit HashTrieJournal(JournalCodec<T> in_Codec)
+#else
+    explicit HashTrieJournal(JournalCodec<T> in_Codec = DefaultJournalCodec<T>::Codec())
+#endif
+        : codec_(in_Codec), fp_(nullptr), owned_(false), failed_(false), seq_(0), unflushed_(0),
+          flush_records_(kJournalFlushRecords), partial_len_(0) {}
+    HashTrieJournal(const HashTrieJournal&) = delete;
+    HashTrieJournal& operator=(const HashTrieJournal&) = delete;
+    virtual ~HashTrieJournal() {
+        Close();
+    }
+
+    utils::RESULT Open(const char* in_Path);
+    utils::RESULT Attach(FILE* in_Fp, uint64_t in_LastSeq = 0);
+    void          Close();
+    void          Flush();
+    void          SetFlushRecords(uint32_t in_Records) {
+        flush_records_ = in_Records;
+    }
+    //  Last record written. Once Failed(), later changes were not recorded
+    //  and the standby has to fall back to a full reload.
+    uint64_t      LastSeq() const {
+        return seq_;
+    }
+    bool          Failed() const {
+        return failed_;
+    }
+    utils::RESULT Status() const {
+        return failed_ ? utils::RESULT::ERROR : utils::RESULT::OK;
+    }
+
+    void Record(TrieChange in_Op, uint32_t in_Key, const T* in_Data) override;
+
+    uint64_t Replay(FILE* in_Fp, HashTrie<T>& in_Trie, uint64_t in_LastSeq,
+                    utils::RESULT* out_Status = nullptr);
+    //  Bytes of an incomplete trailing record kept by the last Replay
+    size_t   ReplayPartialBytes() const {
+        return partial_len_;
+    }
+
+ private:
+    JournalCodec<T> codec_;
+    FILE*           fp_;
+    bool            owned_;
+    bool            failed_;   //  sticky until the next Open/Attach
+    uint64_t        seq_;
+    uint32_t        unflushed_;
+    uint32_t        flush_records_;
+    uint8_t         partial_[sizeof(JournalRecord)];
+    size_t          partial_len_;
+
+    bool            Apply(const JournalRecord& in_Rec, HashTrie<T>& in_Trie);
+    void            Release(T* in_Data) {
+        if (nullptr != in_Data && codec_.release) {
+            codec_.release(in_Data);
+        }
+    }
+};
+
+//  Appends to in_Path, numbering continues after the last complete record.
+//  A torn record left by a crash is cut off.
+template <typename T>
+utils::RESULT HashTrieJournal<T>::Open(const char* in_Path) {
+    Close();
+    FILE* fp = fopen(in_Path, "a+b");
+    if (nullptr == fp) {
+        printf("Failed to open journal %s\n", in_Path);
+        return utils::RESULT::ERROR;
+    }
+
+    struct stat st;
+    if (0 != fstat(fileno(fp), &st)) {
+        fclose(fp);
+        return utils::RESULT::ERROR;
+    }
+    off_t complete = st.st_size - st.st_size % sizeof(JournalRecord);
+    uint64_t last = 0;
+    if (complete > 0) {
+        JournalRecord rec;
+        if (0 != fseeko(fp, complete - sizeof(rec), SEEK_SET) ||
+            1 != fread(&rec, sizeof(rec), 1, fp)) {
+            fclose(fp);
+            return utils::RESULT::ERROR;
+        }
+        last = rec.seq;
+    }
+    if (complete != st.st_size && 0 != ftruncate(fileno(fp), complete)) {
+        fclose(fp);
+        return utils::RESULT::ERROR;
+    }
+    fseeko(fp, 0, SEEK_END);
+
+    fp_ = fp;
+    owned_ = true;
+    failed_ = false;
+    seq_ = last;
+    return utils::RESULT::OK;
+}
+
+//  Writes to an already open stream (e.g. a pipe to the standby)
+template <typename T>
+utils::RESULT HashTrieJournal<T>::Attach(FILE* in_Fp, uint64_t in_LastSeq) {
+    if (nullptr == in_Fp) {
+        return utils::RESULT::ERROR;
+    }
+    Close();
+    fp_ = in_Fp;
+    owned_ = false;
+    failed_ = false;
+    seq_ = in_LastSeq;
+    return utils::RESULT::OK;
+}
+
+template <typename T>
+void HashTrieJournal<T>::Close() {
+    if (nullptr == fp_) {
+        return;
+    }
+    Flush();
+    if (owned_) {
+        fclose(fp_);
+    }
+    fp_ = nullptr;
+}
+
+template <typename T>
+void HashTrieJournal<T>::Flush() {
+    if (nullptr != fp_ && 0 != unflushed_) {
+        if (0 != fflush(fp_) && !failed_) {
+            printf("Failed to flush journal after record %lu\n", static_cast<unsigned long>(seq_));
+            failed_ = true;
+        }
+        unflushed_ = 0;
+    }
+}
+
+template <typename T>
+void HashTrieJournal<T>::Record(TrieChange in_Op, uint32_t in_Key, const T* in_Data) {
+    if (nullptr == fp_ || failed_) {
+        return;
+    }
+    JournalRecord rec;
+    rec.seq = seq_ + 1;
+    rec.value = (nullptr != in_Data) ? codec_.encode(in_Data) : 0;
+    rec.key = in_Key;
+    rec.op = static_cast<uint8_t>(in_Op);
+    if (1 != fwrite(&rec, sizeof(rec), 1, fp_)) {
+        printf("Failed to write journal record %lu, journal stopped\n",
+               static_cast<unsigned long>(rec.seq));
+        failed_ = true;
+        return;
+    }
+    seq_ = rec.seq;
+    if (++unflushed_ >= flush_records_) {
+        Flush();
+    }
+}
+
+template <typename T>
+bool HashTrieJournal<T>::Apply(const JournalRecord& in_Rec, HashTrie<T>& in_Trie) {
+    T* old = nullptr;
+    T* data = nullptr;
+    switch (static_cast<TrieChange>(in_Rec.op)) {
+        case TrieChange::ADD:
+            data = codec_.decode(in_Rec.value);
+            if (nullptr == data || utils::RESULT::OK != in_Trie.HashTrieAddNode(in_Rec.key, data)) {
+                Release(data);
+                return false;
+            }
+            return true;
+        case TrieChange::REMOVE:
+            if (!in_Trie.HashTrieRemoveNode(in_Rec.key, &old)) {
+                return false;
+            }
+            Release(old);
+            return true;
+        case TrieChange::REPLACE:
+            data = codec_.decode(in_Rec.value);
+            if (nullptr == data || !in_Trie.HashTrieReplaceNode(in_Rec.key, data, &old)) {
+                Release(data);
+                return false;
+            }
+            Release(old);
+            return true;
+    }
+    return false;
+}
+
+//  Applies the records of in_Fp following in_LastSeq to in_Trie until end of
+//  stream and returns the sequence number of the last one applied. Stops
+//  with ERROR on a sequence gap or a record the trie rejects, the standby
+//  then has to fall back to a full reload.
+//
+//  A record cut short by the end of the stream is kept and completed by the
+//  next call on the same stream, so a standby can poll a journal that is
+//  still being written. If ReplayPartialBytes() stays non zero once the
+//  active is gone, the journal ends in a torn record.
+template <typename T>
+uint64_t HashTrieJournal<T>::Replay(FILE* in_Fp, HashTrie<T>& in_Trie, uint64_t in_LastSeq,
+                                    utils::RESULT* out_Status) {
+    utils::RESULT status = utils::RESULT::OK;
+    JournalRecord rec;
+    clearerr(in_Fp);
+    while (1) {
+        partial_len_ += fread(partial_ + partial_len_, 1, sizeof(partial_) - partial_len_, in_Fp);
+        if (partial_len_ < sizeof(partial_)) {
+            if (ferror(in_Fp)) {
+                printf("Failed to read journal after record %lu\n",
+                       static_cast<unsigned long>(in_LastSeq));
+                status = utils::RESULT::ERROR;
+            }
+            break;
+        }
+        memcpy(&rec, partial_, sizeof(rec));
+        partial_len_ = 0;
+        if (rec.seq <= in_LastSeq) {
+            continue;
+        }
+        if (rec.seq != in_LastSeq + 1) {
+            printf("Journal gap: expected %lu got %lu\n",
+                   static_cast<unsigned long>(in_LastSeq + 1), static_cast<unsigned long>(rec.seq));
+            status = utils::RESULT::ERROR;
+            break;
+        }
+        if (!Apply(rec, in_Trie)) {
+            printf("Failed to apply journal record %lu\n", static_cast<unsigned long>(rec.seq));
+            status = utils::RESULT::ERROR;
+            break;
+        }
+        in_LastSeq = rec.seq;
+    }
+    if (nullptr != out_Status) {
+        *out_Status = status;
+    }
+    return in_LastSeq;
+}
+}  //  namespace hash
+#endif  // USERPLANE_TRIE_JOURNAL_HPP_
@@ -0,0 +1,388 @@
+#ifndef USERPLANE_TRIE_UPDATER_HPP_
+#define USERPLANE_TRIE_UPDATER_HPP_
+
+/**
+ * Asynchronous update pipeline for HashTrie.
+ *
+ * Control plane threads enqueue add/remove/replace commands into a lock free
+ * MPSC ring and return immediately. A dedicated applier thread, which becomes
+ * the only writer of the trie, drains the ring in batches, coalesces commands
+ * on the same key and waits for one grace period per batch. While a slow
+ * reader holds that grace period up, the applier keeps applying new commands
+ * into the same open batch instead of blocking, up to kUpdateMaxOpenCmds
+ * commands or kUpdateMaxOpenUsec. Past either it stops dequeuing and waits
+ * for the grace period, so held back results and retired nodes stay bounded.
+ *
+ * Being the only writer, the applier is also where HashTrieCompactStep has
+ * to run: enable it with SetCompaction. Steps run between batches inside a
+ * trie batch of their own, so their grace periods never block the applier.
+ *
+ * Data returned through UpdateResult::old_data (removed or replaced values)
+ * is only handed out after that grace period, so it can be freed at once.
+ * If Stop finds a reader still holding the last grace period after
+ * kUpdateStopTimeoutUsec, it takes the trie out of batch mode and completes
+ * the waiting results without old_data: applied commands report OK, their
+ * old values are left allocated, as freeing them is not safe.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <thread>  //  NOLINT
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "mpsc_ring.hpp"
+#include "mbit_trie.hpp"
+
+namespace hash {
+const uint32_t kUpdateRingSize   = 4096;
+const uint32_t kUpdateBatchSize  = 256;
+const uint32_t kUpdateIdleSpin   = 128;   /* Empty polls before yielding */
+const uint32_t kUpdateIdleSleepUsec = 50;
+const uint32_t kUpdateGraceSliceUsec = 100;  /* Wait per try when idle with an open batch */
+const uint32_t kUpdateStopTimeoutUsec = 1000000;  /* Longest wait for the last grace period on Stop */
+const uint32_t kUpdateMaxOpenCmds = 16 * kUpdateBatchSize;  /* Commands applied into one open batch */
+const uint32_t kUpdateMaxOpenUsec = 10000;   /* Age after which an open batch takes no more commands */
+
+enum class UpdateOp : uint8_t {
+    ADD = 0,
+    REMOVE,
+    REPLACE
+};
+
+template <typename T>
+struct UpdateResult {
+    utils::RESULT status;
+    T*            old_data;
+};
+
+template <typename T>
+class HashTrieUpdater {
+ public:
+    explicit HashTrieUpdater(HashTrie<T>* trie)
+        : trie_(trie), running_(false), enqueuers_(0), compact_(false) {}
+    HashTrieUpdater(const HashTrieUpdater&) = delete;
+    HashTrieUpdater& operator=(const HashTrieUpdater&) = delete;
+    virtual ~HashTrieUpdater() {
+        Stop();
+    }
+
+    void Start();
+    void Stop();
+    void SetCompaction(bool in_Enable) {
+        compact_.store(in_Enable, std::memory_order_relaxed);
+    }
+
+    //  Control plane API, callable from any thread. Returns false if the ring
+    //  is full or the updater is not running. If done is given it receives
+    //  the result once applied.
+    bool Add(uint32_t in_Key, T* in_Data, std::future<UpdateResult<T>>* done = nullptr) {
+        return Enqueue(UpdateOp::ADD, in_Key, in_Data, done);
+    }
+    bool Remove(uint32_t in_Key, std::future<UpdateResult<T>>* done = nullptr) {
+        return Enqueue(UpdateOp::REMOVE, in_Key, nullptr, done);
+    }
+    bool Replace(uint32_t in_Key, T* in_Data, std::future<UpdateResult<T>>* done = nullptr) {
+        return Enqueue(UpdateOp::REPLACE, in_Key, in_Data, done);
+    }
+
+ private:
+    struct UpdateCmd {
+        UpdateOp                           op;
+        uint32_t                           key;
+        T*                                 data;
+        std::promise<UpdateResult<T>>*     done;
+    };
+
+    //  Per key view of a batch: value in the trie before the batch and the
+    //  value left after simulating the batch commands in order, then whether
+    //  the trie took the net change and what it unlinked.
+    struct KeyState {
+        uint32_t  key;
+        T*        orig;
+        T*        cur;
+        bool      applied;
+        T*        unlinked;
+    };
+
+    HashTrie<T>*                                   trie_;
+    lock::MPSCRing<UpdateCmd, kUpdateRingSize>     ring_;
+    std::atomic<bool>                              running_;
+    std::atomic<uint32_t>                          enqueuers_;  //  producers inside Enqueue
+    std::atomic<bool>                              compact_;
+    std::thread                                    applier_;
+
+    UpdateCmd                                      batch_[kUpdateBatchSize];
+    UpdateResult<T>                                results_[kUpdateBatchSize];
+    size_t                                         state_of_[kUpdateBatchSize];
+    std::unordered_map<uint32_t, size_t>           index_;
+    std::vector<KeyState>                          states_;
+
+    //  Results held back until the open trie batch passes its grace period
+    bool                                           batch_open_ = false;
+    uint32_t                                       batch_cmds_ = 0;
+    std::chrono::steady_clock::time_point          batch_start_;
+    std::vector<std::pair<std::promise<UpdateResult<T>>*, UpdateResult<T>>> pending_;
+
+    bool Enqueue(UpdateOp op, uint32_t in_Key, T* in_Data,
+                 std::future<UpdateResult<T>>* done);
+    void Run();
+    void OpenBatch();
+    void ApplyBatch(uint32_t count);
+    void Compact();
+    void CompletePending();
+    void AbandonPending();
+};
+
+template <typename T>
+void HashTrieUpdater<T>::Start() {
+    if (running_.exchange(true)) {
+        return;
+    }
+    applier_ = std::thread(&HashTrieUpdater<T>::Run, this);
+}
+
+//  Stops the applier after draining whatever is already in the ring. The
+//  wait for the last grace period is bounded by kUpdateStopTimeoutUsec.
+template <typename T>
+void HashTrieUpdater<T>::Stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    applier_.join();
+
+    //  Fail whatever producers managed to queue after the applier left
+    while (0 != enqueuers_.load(std::memory_order_seq_cst)) {
+        utils::pause();
+    }
+    uint32_t count;
+    while (0 != (count = ring_.dequeue_burst(batch_, kUpdateBatchSize))) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (nullptr != batch_[i].done) {
+                batch_[i].done->set_value({utils::RESULT::ERROR, nullptr});
+                delete batch_[i].done;
+            }
+        }
+    }
+}
+
+template <typename T>
+bool HashTrieUpdater<T>::Enqueue(UpdateOp op, uint32_t in_Key, T* in_Data,
+                                 std::future<UpdateResult<T>>* done) {
+    enqueuers_.fetch_add(1, std::memory_order_seq_cst);
+    if (!running_.load(std::memory_order_seq_cst)) {
+        enqueuers_.fetch_sub(1, std::memory_order_release);
+        if (nullptr != done) {
+            *done = std::future<UpdateResult<T>>();
+        }
+        return false;
+    }
+    UpdateCmd cmd = {op, in_Key, in_Data, nullptr};
+    if (nullptr != done) {
+        cmd.done = new std::promise<UpdateResult<T>>();
+        *done = cmd.done->get_future();
+    }
+    bool queued = ring_.enqueue(cmd);
+    enqueuers_.fetch_sub(1, std::memory_order_release);
+    if (!queued) {
+        delete cmd.done;
+        if (nullptr != done) {
+            *done = std::future<UpdateResult<T>>();
+        }
+        return false;
+    }
+    return true;
+}
+
+template <typename T>
+void HashTrieUpdater<T>::Run() {
+    uint32_t idle = 0;
+    bool stopping = false;
+    std::chrono::steady_clock::time_point stop_deadline;
+    while (1) {
+        uint32_t count = 0;
+        bool batch_full = batch_open_ &&
+                (batch_cmds_ >= kUpdateMaxOpenCmds ||
+                 std::chrono::steady_clock::now() - batch_start_ >=
+                 std::chrono::microseconds(kUpdateMaxOpenUsec));
+        if (!batch_full) {
+            count = ring_.dequeue_burst(batch_, kUpdateBatchSize);
+        }
+        if (count > 0) {
+            idle = 0;
+            ApplyBatch(count);
+        } else if (compact_.load(std::memory_order_relaxed) &&
+                   running_.load(std::memory_order_relaxed)) {
+            Compact();
+        }
+        if (batch_open_) {
+            std::chrono::microseconds wait(count > 0 ? 0 : kUpdateGraceSliceUsec);
+            if (trie_->HashTrieEndBatchFor(wait)) {
+                batch_open_ = false;
+                CompletePending();
+            } else if (0 == count && !running_.load(std::memory_order_acquire)) {
+                auto now = std::chrono::steady_clock::now();
+                if (!stopping) {
+                    stopping = true;
+                    stop_deadline = now + std::chrono::microseconds(kUpdateStopTimeoutUsec);
+                } else if (now >= stop_deadline) {
+                    printf("Trie updater stopped with an open batch, %lu results "
+                           "completed without old data\n",
+                           static_cast<unsigned long>(pending_.size()));
+                    trie_->HashTrieAbandonBatch();
+                    batch_open_ = false;
+                    AbandonPending();
+                    break;
+                }
+            }
+            continue;
+        }
+        if (count > 0) {
+            continue;
+        }
+        if (!running_.load(std::memory_order_acquire)) {
+            break;
+        }
+        if (++idle < kUpdateIdleSpin) {
+            utils::pause();
+        } else if (idle < 2 * kUpdateIdleSpin) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(kUpdateIdleSleepUsec));
+        }
+    }
+}
+
+template <typename T>
+void HashTrieUpdater<T>::OpenBatch() {
+    if (!batch_open_) {
+        trie_->HashTrieBeginBatch();
+        batch_open_ = true;
+        batch_cmds_ = 0;
+        batch_start_ = std::chrono::steady_clock::now();
+    }
+}
+
+template <typename T>
+void HashTrieUpdater<T>::ApplyBatch(uint32_t count) {
+    index_.clear();
+    states_.clear();
+
+    //  Simulate the commands in order on the per key state
+    for (uint32_t i = 0; i < count; i++) {
+        const UpdateCmd& cmd = batch_[i];
+        UpdateResult<T>& result = results_[i];
+        result = {utils::RESULT::ERROR, nullptr};
+        state_of_[i] = SIZE_MAX;
+        if (!trie_->HashTrieIsValidKey(cmd.key)) {
+            continue;
+        }
+
+        auto it = index_.find(cmd.key);
+        if (it == index_.end()) {
+            T* orig = trie_->HashTrieGetNode(cmd.key);
+            it = index_.emplace(cmd.key, states_.size()).first;
+            states_.push_back({cmd.key, orig, orig, true, nullptr});
+        }
+        state_of_[i] = it->second;
+        KeyState& state = states_[it->second];
+
+        switch (cmd.op) {
+            case UpdateOp::ADD:
+                if (nullptr == state.cur && nullptr != cmd.data) {
+                    state.cur = cmd.data;
+                    result.status = utils::RESULT::OK;
+                }
+                break;
+            case UpdateOp::REMOVE:
+                if (nullptr != state.cur) {
+                    result = {utils::RESULT::OK, state.cur};
+                    state.cur = nullptr;
+                }
+                break;
+            case UpdateOp::REPLACE:
+                if (nullptr != state.cur && nullptr != cmd.data) {
+                    result = {utils::RESULT::OK, state.cur};
+                    state.cur = cmd.data;
+                }
+                break;
+        }
+    }
+
+    //  Apply only the net change per key, reclaim once for the whole batch
+    OpenBatch();
+    batch_cmds_ += count;
+    for (KeyState& state : states_) {
+        T* old = nullptr;
+        if (state.orig == state.cur) {
+            continue;
+        } else if (nullptr == state.orig) {
+            state.applied = (utils::RESULT::OK == trie_->HashTrieAddNode(state.key, state.cur));
+        } else if (nullptr == state.cur) {
+            state.applied = trie_->HashTrieRemoveNode(state.key, &old);
+        } else {
+            state.applied = trie_->HashTrieReplaceNode(state.key, state.cur, &old);
+        }
+        state.unlinked = old;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (SIZE_MAX != state_of_[i]) {
+            const KeyState& state = states_[state_of_[i]];
+            if (!state.applied) {
+                //  Net change rejected (e.g. out of nodes): none of the key's
+                //  commands took effect and every value stays with its caller
+                results_[i] = {utils::RESULT::ERROR, nullptr};
+            } else if (results_[i].old_data == state.orig) {
+                //  Hand out the value from before the batch only if the trie
+                //  unlinked it, a batch ending on the same value leaves it live
+                results_[i].old_data = state.unlinked;
+            }
+        }
+        if (nullptr != batch_[i].done) {
+            pending_.emplace_back(batch_[i].done, results_[i]);
+        }
+    }
+}
+
+template <typename T>
+void HashTrieUpdater<T>::CompletePending() {
+    for (auto& pending : pending_) {
+        pending.first->set_value(pending.second);
+        delete pending.first;
+    }
+    pending_.clear();
+}
+
+//  One compaction step between batches. Opens a trie batch only if the step
+//  replaced a subtree, its grace period then ends like any other batch.
+template <typename T>
+void HashTrieUpdater<T>::Compact() {
+    if (batch_open_) {
+        trie_->HashTrieCompactStep();
+        return;
+    }
+    trie_->HashTrieBeginBatch();
+    if (trie_->HashTrieCompactStep() > 0) {
+        batch_open_ = true;
+        batch_cmds_ = 0;
+        batch_start_ = std::chrono::steady_clock::now();
+    } else {
+        trie_->HashTrieEndBatch();
+    }
+}
+
+//  The trie keeps what was applied, only the old values are withheld
+template <typename T>
+void HashTrieUpdater<T>::AbandonPending() {
+    for (auto& pending : pending_) {
+        pending.first->set_value({pending.second.status, nullptr});
+        delete pending.first;
+    }
+    pending_.clear();
+}
+}  //  namespace hash
+#endif  // USERPLANE_TRIE_UPDATER_HPP_